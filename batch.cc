@@ -0,0 +1,157 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <thread>
+
+#include "batch.h"
+
+using namespace std;
+
+void read_input_vectors(const char * path, vector< vector<int> > & input_vectors)
+{
+    FILE * file = fopen(path, "r");
+    if (file == NULL)
+    {
+        debug("Error: cannot open batch input file %s.\n", path);
+        exit(1);
+    }
+
+    char * line = NULL;
+    size_t capacity = 0;
+    int line_no = 0;
+    while (getline(&line, &capacity, file) != -1)
+    {
+        vector<int> values;
+        char * cursor = line;
+        line_no++;
+        for (;;)
+        {
+            char * end;
+            errno = 0;
+            long value = strtol(cursor, &end, 10);
+            if (end == cursor)
+                break;
+            if (errno != 0 || value != (int) value)
+            {
+                debug("Error: input out of range at %s:%d.\n", path, line_no);
+                exit(1);
+            }
+            values.push_back((int) value);
+            cursor = end;
+        }
+        while (*cursor == ' ' || *cursor == '\t' || *cursor == '\r' || *cursor == '\n')
+            cursor++;
+        if (*cursor != '\0')
+        {
+            debug("Error: expected a number at %s:%d.\n", path, line_no);
+            exit(1);
+        }
+        input_vectors.push_back(values);
+    }
+    free(line);
+    fclose(file);
+}
+
+/*
+ * Each worker owns a range of job indices. The owner takes jobs from the
+ * front; an idle worker steals the back half of another worker's range.
+ */
+struct WorkRange
+{
+    mutex lock;
+    size_t begin;
+    size_t end;
+};
+
+static bool take_job(WorkRange & range, size_t & job)
+{
+    lock_guard<mutex> guard(range.lock);
+    if (range.begin == range.end)
+        return false;
+    job = range.begin++;
+    return true;
+}
+
+static bool steal_jobs(vector<WorkRange> & ranges, int thief)
+{
+    int n = ranges.size();
+    for (int i = 1; i < n; i++)
+    {
+        WorkRange & victim = ranges[(thief + i) % n];
+        size_t begin, end;
+        {
+            lock_guard<mutex> guard(victim.lock);
+            size_t remaining = victim.end - victim.begin;
+            if (remaining < 2)
+                continue;
+            end = victim.end;
+            begin = end - remaining / 2;
+            victim.end = begin;
+        }
+        lock_guard<mutex> guard(ranges[thief].lock);
+        ranges[thief].begin = begin;
+        ranges[thief].end = end;
+        return true;
+    }
+    return false;
+}
+
+static void run_worker(ExecutionEngine engine, const CompiledProgram & program,
+                       const BytecodeProgram & bytecode,
+                       const vector< vector<int> > & input_vectors,
+                       vector<WorkRange> & ranges, int self, vector<string> & outputs,
+                       vector<const char *> & errors)
+{
+    OutputSink sink(-1);
+    ExecutionContext context(program, &sink);
+    size_t job;
+
+    for (;;)
+    {
+        if (!take_job(ranges[self], job))
+        {
+            if (steal_jobs(ranges, self))
+                continue;
+            // A range with a single job left is not stolen; its owner is
+            // already running or about to run it
+            return;
+        }
+
+        sink.Clear();
+        context.Reset(input_vectors[job]);
+        execute_with_engine(engine, program, bytecode, context);
+        outputs[job].assign(sink.Data(), sink.Size());
+        errors[job] = context.error;
+    }
+}
+
+void execute_batch(ExecutionEngine engine, const CompiledProgram & program,
+                   const BytecodeProgram & bytecode,
+                   const vector< vector<int> > & input_vectors,
+                   int threads, vector<string> & outputs, vector<const char *> & errors)
+{
+    size_t jobs = input_vectors.size();
+    if (threads < 1)
+        threads = 1;
+    if ((size_t) threads > jobs)
+        threads = jobs > 0 ? jobs : 1;
+
+    outputs.assign(jobs, string());
+    errors.assign(jobs, NULL);
+    vector<WorkRange> ranges(threads);
+    for (int i = 0; i < threads; i++)
+    {
+        ranges[i].begin = jobs * i / threads;
+        ranges[i].end = jobs * (i + 1) / threads;
+    }
+
+    vector<thread> workers;
+    for (int i = 1; i < threads; i++)
+        workers.push_back(thread(run_worker, engine, cref(program), cref(bytecode),
+                                 cref(input_vectors), ref(ranges), i, ref(outputs),
+                                 ref(errors)));
+    run_worker(engine, program, bytecode, input_vectors, ranges, 0, outputs, errors);
+    for (size_t i = 0; i < workers.size(); i++)
+        workers[i].join();
+}
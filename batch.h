@@ -0,0 +1,28 @@
+#ifndef _BATCH_H_
+#define _BATCH_H_
+
+#include <string>
+#include <vector>
+
+#include "compiler.h"
+#include "bytecode.h"
+
+// Reads one input vector per line of path; a blank line is an empty one.
+// Exits on a malformed file.
+void read_input_vectors(const char * path, std::vector< std::vector<int> > & input_vectors);
+
+/*
+ * Executes program once per input vector on a work-stealing pool of
+ * `threads` workers. Each worker owns one ExecutionContext that is reset
+ * to the program's memory image before every run. outputs[i] receives
+ * everything execution i printed, so results come back in input order
+ * regardless of which worker ran them. errors[i] is NULL, or why execution
+ * i stopped early; the other executions run regardless.
+ */
+void execute_batch(ExecutionEngine engine, const CompiledProgram & program,
+                   const BytecodeProgram & bytecode,
+                   const std::vector< std::vector<int> > & input_vectors,
+                   int threads, std::vector<std::string> & outputs,
+                   std::vector<const char *> & errors);
+
+#endif /* _BATCH_H_ */
@@ -0,0 +1,896 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "bytecode.h"
+
+using namespace std;
+
+static BytecodeInstruction make_instruction(BytecodeOpcode opcode)
+{
+    BytecodeInstruction inst;
+    inst.opcode = opcode;
+    inst.reserved[0] = inst.reserved[1] = inst.reserved[2] = 0;
+    inst.a = 0;
+    inst.b = 0;
+    inst.c = 0;
+    return inst;
+}
+
+static BytecodeOpcode assign_opcode(ArithmeticOperatorType op)
+{
+    switch (op)
+    {
+        case OPERATOR_PLUS:  return BC_ASSIGN_ADD;
+        case OPERATOR_MINUS: return BC_ASSIGN_SUB;
+        case OPERATOR_MULT:  return BC_ASSIGN_MULT;
+        case OPERATOR_DIV:   return BC_ASSIGN_DIV;
+        default:             return BC_ASSIGN_MOV;
+    }
+}
+
+static BytecodeOpcode cjmp_opcode(ConditionalOperatorType condition)
+{
+    switch (condition)
+    {
+        case CONDITION_GREATER:       return BC_CJMP_GREATER;
+        case CONDITION_LESS:          return BC_CJMP_LESS;
+        case CONDITION_EQUAL:         return BC_CJMP_EQUAL;
+        case CONDITION_GREATER_EQUAL: return BC_CJMP_GREATER_EQUAL;
+        case CONDITION_LESS_EQUAL:    return BC_CJMP_LESS_EQUAL;
+        default:                      return BC_CJMP_NOTEQUAL;
+    }
+}
+
+static BytecodeOpcode immediate_form(BytecodeOpcode opcode)
+{
+    switch (opcode)
+    {
+        case BC_ASSIGN_MOV:         return BC_ASSIGN_MOV_IMM;
+        case BC_ASSIGN_ADD:         return BC_ASSIGN_ADD_IMM;
+        case BC_ASSIGN_SUB:         return BC_ASSIGN_SUB_IMM;
+        case BC_ASSIGN_MULT:        return BC_ASSIGN_MULT_IMM;
+        case BC_ASSIGN_DIV:         return BC_ASSIGN_DIV_IMM;
+        case BC_CJMP_GREATER:       return BC_CJMP_GREATER_IMM;
+        case BC_CJMP_LESS:          return BC_CJMP_LESS_IMM;
+        case BC_CJMP_EQUAL:         return BC_CJMP_EQUAL_IMM;
+        case BC_CJMP_GREATER_EQUAL: return BC_CJMP_GREATER_EQUAL_IMM;
+        case BC_CJMP_LESS_EQUAL:    return BC_CJMP_LESS_EQUAL_IMM;
+        default:                    return BC_CJMP_NOTEQUAL_IMM;
+    }
+}
+
+// Moves a constant-pool operand into the instruction. Commutative operators
+// and comparisons are flipped when only the first operand is a literal.
+static void encode_immediate(const vector<bool> & is_constant, const vector<int> & image,
+                             BytecodeInstruction & inst)
+{
+    if (inst.opcode == BC_ASSIGN_MOV)
+    {
+        if (is_constant[inst.b])
+        {
+            inst.opcode = BC_ASSIGN_MOV_IMM;
+            inst.b = (uint32_t) image[inst.b];
+        }
+        return;
+    }
+
+    if (!is_constant[inst.c] && is_constant[inst.b])
+    {
+        switch (inst.opcode)
+        {
+            case BC_ASSIGN_ADD:
+            case BC_ASSIGN_MULT:
+            case BC_CJMP_NOTEQUAL:
+            case BC_CJMP_EQUAL:
+                break;
+            case BC_CJMP_GREATER:
+                inst.opcode = BC_CJMP_LESS;
+                break;
+            case BC_CJMP_LESS:
+                inst.opcode = BC_CJMP_GREATER;
+                break;
+            case BC_CJMP_GREATER_EQUAL:
+                inst.opcode = BC_CJMP_LESS_EQUAL;
+                break;
+            case BC_CJMP_LESS_EQUAL:
+                inst.opcode = BC_CJMP_GREATER_EQUAL;
+                break;
+            default:
+                return;
+        }
+        uint32_t operand = inst.b;
+        inst.b = inst.c;
+        inst.c = operand;
+    }
+
+    if (is_constant[inst.c])
+    {
+        inst.opcode = immediate_form((BytecodeOpcode) inst.opcode);
+        inst.c = (uint32_t) image[inst.c];
+    }
+}
+
+void encode_operation(InstructionNode * node, const vector<bool> & is_constant,
+                      const vector<int> & image, BytecodeInstruction & inst)
+{
+    if (node->type == ASSIGN)
+        inst.opcode = assign_opcode(node->assign_inst.op);
+    else
+        inst.opcode = cjmp_opcode(node->cjmp_inst.condition_op);
+    encode_immediate(is_constant, image, inst);
+}
+
+void compile_bytecode(const CompiledProgram & program, BytecodeProgram & bytecode)
+{
+    unordered_map<InstructionNode*, uint32_t> location;
+    vector<pair<uint32_t, InstructionNode*> > fixups;   // (record, jump target)
+    vector<InstructionNode*> pending;
+
+    bytecode.code.clear();
+    pending.push_back(program.head);
+
+    while (!pending.empty())
+    {
+        InstructionNode* node = pending.back();
+        pending.pop_back();
+        if (node == NULL || location.count(node) != 0)
+            continue;
+
+        bool falls_through = true;
+        while (node != NULL && location.count(node) == 0)
+        {
+            uint32_t here = bytecode.code.size();
+            location[node] = here;
+
+            BytecodeInstruction inst = make_instruction(BC_NOOP);
+            falls_through = true;
+            switch (node->type)
+            {
+                case NOOP:
+                    break;
+                case IN:
+                    inst.opcode = BC_IN;
+                    inst.a = node->input_inst.var_index;
+                    break;
+                case OUT:
+                    inst.opcode = BC_OUT;
+                    inst.a = node->output_inst.var_index;
+                    break;
+                case ASSIGN:
+                    inst.a = node->assign_inst.left_hand_side_index;
+                    inst.b = node->assign_inst.operand1_index;
+                    inst.c = node->assign_inst.operand2_index;
+                    encode_operation(node, program.is_constant, program.memory_image, inst);
+                    break;
+                case CJMP:
+                    if (node->cjmp_inst.target == NULL)
+                    {
+                        debug("Error: pc->cjmp_inst->target is null.\n");
+                        exit(1);
+                    }
+                    inst.b = node->cjmp_inst.operand1_index;
+                    inst.c = node->cjmp_inst.operand2_index;
+                    encode_operation(node, program.is_constant, program.memory_image, inst);
+                    fixups.push_back(make_pair(here, node->cjmp_inst.target));
+                    pending.push_back(node->cjmp_inst.target);
+                    break;
+                case JMP:
+                    if (node->jmp_inst.target == NULL)
+                    {
+                        debug("Error: pc->jmp_inst->target is null.\n");
+                        exit(1);
+                    }
+                    inst.opcode = BC_JMP;
+                    fixups.push_back(make_pair(here, node->jmp_inst.target));
+                    pending.push_back(node->jmp_inst.target);
+                    falls_through = false;
+                    break;
+                default:
+                    debug("Error: invalid value for pc->type (%d).\n", node->type);
+                    exit(1);
+                    break;
+            }
+            bytecode.code.push_back(inst);
+            node = node->next;
+        }
+
+        // The chain either ran into code that is already laid out or ended
+        if (node != NULL)
+        {
+            BytecodeInstruction jump = make_instruction(BC_JMP);
+            fixups.push_back(make_pair((uint32_t) bytecode.code.size(), node));
+            bytecode.code.push_back(jump);
+        }
+        else if (falls_through)
+        {
+            bytecode.code.push_back(make_instruction(BC_HALT));
+        }
+    }
+
+    if (bytecode.code.empty())
+        bytecode.code.push_back(make_instruction(BC_HALT));
+
+    for (size_t i = 0; i < fixups.size(); i++)
+        bytecode.code[fixups[i].first].a = location[fixups[i].second];
+    lower_switches(bytecode);
+    fuse_superinstructions(bytecode);
+}
+
+static bool case_before(const pair<int32_t, uint32_t> & x, const pair<int32_t, uint32_t> & y)
+{
+    return x.first < y.first;
+}
+
+// Builds the table for the run of tests starting at head
+static void make_switch(BytecodeProgram & bytecode, uint32_t head, uint32_t length)
+{
+    vector< pair<int32_t, uint32_t> > cases;       // value, target
+    unordered_map<int32_t, bool> seen;
+    for (uint32_t pc = head; pc < head + length; pc++)
+    {
+        const BytecodeInstruction & test = bytecode.code[pc];
+        int32_t value = (int32_t) test.c;
+        if (seen.insert(make_pair(value, true)).second)
+            cases.push_back(make_pair(value, test.a));
+    }
+    sort(cases.begin(), cases.end(), case_before);
+
+    SwitchTable table;
+    table.low = cases.front().first;
+    int64_t span = (int64_t) cases.back().first - table.low + 1;
+    BytecodeInstruction inst = make_instruction(BC_SWITCH_SEARCH);
+    if (span <= (int64_t) cases.size() * SWITCH_TABLE_DENSITY)
+    {
+        inst.opcode = BC_SWITCH_TABLE;
+        table.targets.assign(span, head + length);
+        for (size_t i = 0; i < cases.size(); i++)
+            table.targets[(int64_t) cases[i].first - table.low] = cases[i].second;
+    }
+    else
+    {
+        for (size_t i = 0; i < cases.size(); i++)
+        {
+            table.keys.push_back(cases[i].first);
+            table.targets.push_back(cases[i].second);
+        }
+    }
+    inst.a = bytecode.switches.size();
+    inst.b = bytecode.code[head].b;
+    inst.c = head + length;
+    bytecode.switches.push_back(table);
+    bytecode.code[head] = inst;
+}
+
+void lower_switches(BytecodeProgram & bytecode)
+{
+    bytecode.switches.clear();
+    vector<BytecodeInstruction> & code = bytecode.code;
+    uint32_t pc = 0;
+    while (pc < code.size())
+    {
+        uint32_t length = 0;
+        while (pc + length < code.size() && code[pc + length].opcode == BC_CJMP_NOTEQUAL_IMM &&
+               code[pc + length].b == code[pc].b)
+            length++;
+        if (length >= SWITCH_MIN_CASES)
+            make_switch(bytecode, pc, length);
+        pc += length > 0 ? length : 1;
+    }
+}
+
+void fuse_superinstructions(BytecodeProgram & bytecode)
+{
+    vector<BytecodeInstruction> & code = bytecode.code;
+    vector<uint8_t> original(code.size());
+    for (size_t pc = 0; pc < code.size(); pc++)
+        original[pc] = unfused_opcode(code[pc].opcode);
+
+    // A JMP pairs with the instruction at its target, which always exists.
+    // Every other pair is an instruction and the one after it; the code
+    // ends in a JMP or HALT, and HALT stands in past the end.
+    for (size_t pc = 0; pc < code.size(); pc++)
+    {
+        uint8_t next = pc + 1 < code.size() ? original[pc + 1] : (uint8_t) BC_HALT;
+        switch (original[pc])
+        {
+            case BC_ASSIGN_ADD_IMM:
+                if (next != BC_JMP)
+                    break;
+                if (original[code[pc + 1].a] == BC_CJMP_LESS_IMM)
+                    code[pc].opcode = BC_ADD_IMM_LOOP_LESS_IMM;
+                else
+                    code[pc].opcode = BC_ADD_IMM_JMP;
+                break;
+            case BC_ASSIGN_SUB_IMM:
+                // The latch of a loop counting down
+                if (next != BC_JMP)
+                    break;
+                if (original[code[pc + 1].a] == BC_CJMP_GREATER_IMM)
+                    code[pc].opcode = BC_SUB_IMM_LOOP_GREATER_IMM;
+                else
+                    code[pc].opcode = BC_SUB_IMM_JMP;
+                break;
+            case BC_JMP:
+                if (original[code[pc].a] == BC_CJMP_LESS)
+                    code[pc].opcode = BC_JMP_LESS;
+                else if (original[code[pc].a] == BC_CJMP_LESS_IMM)
+                    code[pc].opcode = BC_JMP_LESS_IMM;
+                else if (original[code[pc].a] == BC_CJMP_GREATER)
+                    code[pc].opcode = BC_JMP_GREATER;
+                else if (original[code[pc].a] == BC_CJMP_GREATER_IMM)
+                    code[pc].opcode = BC_JMP_GREATER_IMM;
+                break;
+            case BC_CJMP_GREATER_IMM:
+                if (next == BC_ASSIGN_ADD_IMM)
+                    code[pc].opcode = BC_CJMP_GREATER_IMM_ADD_IMM;
+                break;
+            case BC_CJMP_LESS_IMM:
+                if (next == BC_ASSIGN_ADD_IMM)
+                    code[pc].opcode = BC_CJMP_LESS_IMM_ADD_IMM;
+                break;
+            case BC_IN:
+                if (next == BC_IN)
+                    code[pc].opcode = BC_IN_IN;
+                break;
+            case BC_OUT:
+                if (next == BC_OUT)
+                    code[pc].opcode = BC_OUT_OUT;
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+BytecodeOpcode unfused_opcode(uint8_t opcode)
+{
+    switch (opcode)
+    {
+        case BC_ADD_IMM_JMP:
+        case BC_ADD_IMM_LOOP_LESS_IMM:      return BC_ASSIGN_ADD_IMM;
+        case BC_SUB_IMM_JMP:
+        case BC_SUB_IMM_LOOP_GREATER_IMM:   return BC_ASSIGN_SUB_IMM;
+        case BC_JMP_LESS:
+        case BC_JMP_LESS_IMM:
+        case BC_JMP_GREATER:
+        case BC_JMP_GREATER_IMM:            return BC_JMP;
+        case BC_CJMP_GREATER_IMM_ADD_IMM:   return BC_CJMP_GREATER_IMM;
+        case BC_CJMP_LESS_IMM_ADD_IMM:      return BC_CJMP_LESS_IMM;
+        case BC_IN_IN:                      return BC_IN;
+        case BC_OUT_OUT:                    return BC_OUT;
+        default:                            return (BytecodeOpcode) opcode;
+    }
+}
+
+static const char * const opcode_names[] = {
+    "NOOP", "IN", "OUT",
+    "ASSIGN_MOV", "ASSIGN_ADD", "ASSIGN_SUB", "ASSIGN_MULT", "ASSIGN_DIV",
+    "CJMP_GREATER", "CJMP_LESS", "CJMP_NOTEQUAL",
+    "CJMP_EQUAL", "CJMP_GREATER_EQUAL", "CJMP_LESS_EQUAL",
+    "JMP", "HALT",
+    "ASSIGN_MOV_IMM", "ASSIGN_ADD_IMM", "ASSIGN_SUB_IMM",
+    "ASSIGN_MULT_IMM", "ASSIGN_DIV_IMM",
+    "CJMP_GREATER_IMM", "CJMP_LESS_IMM", "CJMP_NOTEQUAL_IMM",
+    "CJMP_EQUAL_IMM", "CJMP_GREATER_EQUAL_IMM", "CJMP_LESS_EQUAL_IMM",
+    "SWITCH_TABLE", "SWITCH_SEARCH",
+    "ADD_IMM_JMP", "ADD_IMM_LOOP_LESS_IMM", "JMP_LESS", "JMP_LESS_IMM",
+    "CJMP_GREATER_IMM_ADD_IMM", "CJMP_LESS_IMM_ADD_IMM", "IN_IN", "OUT_OUT",
+    "SUB_IMM_JMP", "SUB_IMM_LOOP_GREATER_IMM", "JMP_GREATER", "JMP_GREATER_IMM"
+};
+
+static_assert(sizeof(opcode_names) / sizeof(opcode_names[0]) == BC_OPCODE_COUNT,
+              "every opcode needs a name");
+
+static inline uint32_t table_target(const SwitchTable & table, int value, uint32_t otherwise)
+{
+    uint32_t index = (uint32_t) value - (uint32_t) table.low;
+    return index < table.targets.size() ? table.targets[index] : otherwise;
+}
+
+// Binary search that only branches on the loop count
+static inline uint32_t search_target(const SwitchTable & table, int value, uint32_t otherwise)
+{
+    const int32_t * keys = table.keys.data();
+    size_t base = 0;
+    size_t count = table.keys.size();
+    while (count > 1)
+    {
+        size_t half = count / 2;
+        base = keys[base + half] <= value ? base + half : base;
+        count -= half;
+    }
+    return keys[base] == value ? table.targets[base] : otherwise;
+}
+
+// With COUNT_PAIRS, pairs[first * BC_OPCODE_COUNT + second] counts how
+// often opcode second was dispatched right after opcode first
+template <bool COUNT_PAIRS>
+static void run_bytecode(const BytecodeProgram & bytecode, ExecutionContext & context,
+                         uint64_t * pairs)
+{
+    vector<int> frame(bytecode.frame_image);
+    int * mem = frame.empty() ? context.mem : frame.data();
+    const BytecodeInstruction * code = bytecode.code.data();
+    uint32_t pc = 0;
+    uint32_t previous = BC_OPCODE_COUNT;
+
+    for (;;)
+    {
+        const BytecodeInstruction & inst = code[pc];
+        if (COUNT_PAIRS)
+        {
+            if (previous < BC_OPCODE_COUNT)
+                pairs[previous * BC_OPCODE_COUNT + inst.opcode]++;
+            previous = inst.opcode;
+        }
+        switch (inst.opcode)
+        {
+            case BC_NOOP:
+                pc++;
+                break;
+            case BC_IN:
+                mem[inst.a] = context.NextInput();
+                if (context.error != NULL)
+                    return;
+                pc++;
+                break;
+            case BC_OUT:
+                context.output->WriteInt(mem[inst.a]);
+                pc++;
+                break;
+            case BC_ASSIGN_MOV:
+                mem[inst.a] = mem[inst.b];
+                pc++;
+                break;
+            case BC_ASSIGN_ADD:
+                mem[inst.a] = mem[inst.b] + mem[inst.c];
+                pc++;
+                break;
+            case BC_ASSIGN_SUB:
+                mem[inst.a] = mem[inst.b] - mem[inst.c];
+                pc++;
+                break;
+            case BC_ASSIGN_MULT:
+                mem[inst.a] = mem[inst.b] * mem[inst.c];
+                pc++;
+                break;
+            case BC_ASSIGN_DIV:
+                mem[inst.a] = mem[inst.b] / mem[inst.c];
+                pc++;
+                break;
+            case BC_CJMP_GREATER:
+                pc = (mem[inst.b] > mem[inst.c]) ? pc + 1 : inst.a;
+                break;
+            case BC_CJMP_LESS:
+                pc = (mem[inst.b] < mem[inst.c]) ? pc + 1 : inst.a;
+                break;
+            case BC_CJMP_NOTEQUAL:
+                pc = (mem[inst.b] != mem[inst.c]) ? pc + 1 : inst.a;
+                break;
+            case BC_CJMP_EQUAL:
+                pc = (mem[inst.b] == mem[inst.c]) ? pc + 1 : inst.a;
+                break;
+            case BC_CJMP_GREATER_EQUAL:
+                pc = (mem[inst.b] >= mem[inst.c]) ? pc + 1 : inst.a;
+                break;
+            case BC_CJMP_LESS_EQUAL:
+                pc = (mem[inst.b] <= mem[inst.c]) ? pc + 1 : inst.a;
+                break;
+            case BC_JMP:
+                pc = inst.a;
+                break;
+            case BC_HALT:
+                return;
+            case BC_ASSIGN_MOV_IMM:
+                mem[inst.a] = (int) inst.b;
+                pc++;
+                break;
+            case BC_ASSIGN_ADD_IMM:
+                mem[inst.a] = mem[inst.b] + (int) inst.c;
+                pc++;
+                break;
+            case BC_ASSIGN_SUB_IMM:
+                mem[inst.a] = mem[inst.b] - (int) inst.c;
+                pc++;
+                break;
+            case BC_ASSIGN_MULT_IMM:
+                mem[inst.a] = mem[inst.b] * (int) inst.c;
+                pc++;
+                break;
+            case BC_ASSIGN_DIV_IMM:
+                mem[inst.a] = mem[inst.b] / (int) inst.c;
+                pc++;
+                break;
+            case BC_CJMP_GREATER_IMM:
+                pc = (mem[inst.b] > (int) inst.c) ? pc + 1 : inst.a;
+                break;
+            case BC_CJMP_LESS_IMM:
+                pc = (mem[inst.b] < (int) inst.c) ? pc + 1 : inst.a;
+                break;
+            case BC_CJMP_NOTEQUAL_IMM:
+                pc = (mem[inst.b] != (int) inst.c) ? pc + 1 : inst.a;
+                break;
+            case BC_CJMP_EQUAL_IMM:
+                pc = (mem[inst.b] == (int) inst.c) ? pc + 1 : inst.a;
+                break;
+            case BC_CJMP_GREATER_EQUAL_IMM:
+                pc = (mem[inst.b] >= (int) inst.c) ? pc + 1 : inst.a;
+                break;
+            case BC_CJMP_LESS_EQUAL_IMM:
+                pc = (mem[inst.b] <= (int) inst.c) ? pc + 1 : inst.a;
+                break;
+            case BC_SWITCH_TABLE:
+                pc = table_target(bytecode.switches[inst.a], mem[inst.b], inst.c);
+                break;
+            case BC_SWITCH_SEARCH:
+                pc = search_target(bytecode.switches[inst.a], mem[inst.b], inst.c);
+                break;
+            case BC_ADD_IMM_JMP:
+                mem[inst.a] = mem[inst.b] + (int) inst.c;
+                pc = code[pc + 1].a;
+                break;
+            case BC_ADD_IMM_LOOP_LESS_IMM:
+                mem[inst.a] = mem[inst.b] + (int) inst.c;
+                pc = code[pc + 1].a;
+                pc = (mem[code[pc].b] < (int) code[pc].c) ? pc + 1 : code[pc].a;
+                break;
+            case BC_JMP_LESS:
+                pc = inst.a;
+                pc = (mem[code[pc].b] < mem[code[pc].c]) ? pc + 1 : code[pc].a;
+                break;
+            case BC_JMP_LESS_IMM:
+                pc = inst.a;
+                pc = (mem[code[pc].b] < (int) code[pc].c) ? pc + 1 : code[pc].a;
+                break;
+            case BC_CJMP_GREATER_IMM_ADD_IMM:
+                if (mem[inst.b] > (int) inst.c)
+                {
+                    mem[code[pc + 1].a] = mem[code[pc + 1].b] + (int) code[pc + 1].c;
+                    pc += 2;
+                }
+                else
+                {
+                    pc = inst.a;
+                }
+                break;
+            case BC_CJMP_LESS_IMM_ADD_IMM:
+                if (mem[inst.b] < (int) inst.c)
+                {
+                    mem[code[pc + 1].a] = mem[code[pc + 1].b] + (int) code[pc + 1].c;
+                    pc += 2;
+                }
+                else
+                {
+                    pc = inst.a;
+                }
+                break;
+            case BC_IN_IN:
+                mem[inst.a] = context.NextInput();
+                if (context.error != NULL)
+                    return;
+                mem[code[pc + 1].a] = context.NextInput();
+                if (context.error != NULL)
+                    return;
+                pc += 2;
+                break;
+            case BC_OUT_OUT:
+                context.output->WriteInt(mem[inst.a]);
+                context.output->WriteInt(mem[code[pc + 1].a]);
+                pc += 2;
+                break;
+            case BC_SUB_IMM_JMP:
+                mem[inst.a] = mem[inst.b] - (int) inst.c;
+                pc = code[pc + 1].a;
+                break;
+            case BC_SUB_IMM_LOOP_GREATER_IMM:
+                mem[inst.a] = mem[inst.b] - (int) inst.c;
+                pc = code[pc + 1].a;
+                pc = (mem[code[pc].b] > (int) code[pc].c) ? pc + 1 : code[pc].a;
+                break;
+            case BC_JMP_GREATER:
+                pc = inst.a;
+                pc = (mem[code[pc].b] > mem[code[pc].c]) ? pc + 1 : code[pc].a;
+                break;
+            case BC_JMP_GREATER_IMM:
+                pc = inst.a;
+                pc = (mem[code[pc].b] > (int) code[pc].c) ? pc + 1 : code[pc].a;
+                break;
+            default:
+                debug("Error: invalid bytecode opcode (%d).\n", inst.opcode);
+                exit(1);
+                break;
+        }
+    }
+}
+
+void execute_bytecode(const BytecodeProgram & bytecode, ExecutionContext & context)
+{
+    run_bytecode<false>(bytecode, context, NULL);
+}
+
+static bool more_frequent(const pair<uint64_t, uint32_t> & x, const pair<uint64_t, uint32_t> & y)
+{
+    return x.first > y.first;
+}
+
+#define PAIR_REPORT_LIMIT 16
+
+void profile_opcode_pairs(const BytecodeProgram & bytecode, ExecutionContext & context,
+                          FILE * report)
+{
+    vector<uint64_t> pairs(BC_OPCODE_COUNT * BC_OPCODE_COUNT, 0);
+    run_bytecode<true>(bytecode, context, pairs.data());
+
+    vector< pair<uint64_t, uint32_t> > counted;     // count, pair
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < pairs.size(); i++)
+    {
+        if (pairs[i] == 0)
+            continue;
+        counted.push_back(make_pair(pairs[i], i));
+        total += pairs[i];
+    }
+    sort(counted.begin(), counted.end(), more_frequent);
+
+    fprintf(report, "opcode pairs: %llu dispatches after the first\n", (unsigned long long) total);
+    for (size_t i = 0; i < counted.size() && i < PAIR_REPORT_LIMIT; i++)
+    {
+        fprintf(report, "%12llu %5.1f%%  %s -> %s\n", (unsigned long long) counted[i].first,
+                100.0 * counted[i].first / total,
+                opcode_names[counted[i].second / BC_OPCODE_COUNT],
+                opcode_names[counted[i].second % BC_OPCODE_COUNT]);
+    }
+}
+
+#if defined(__GNUC__)
+
+static void thread_code(const BytecodeProgram & bytecode, const void * const * handlers,
+                        vector<ThreadedInstruction> & threaded)
+{
+    threaded.resize(bytecode.code.size());
+    for (size_t i = 0; i < bytecode.code.size(); i++)
+    {
+        const BytecodeInstruction & inst = bytecode.code[i];
+        if (inst.opcode >= BC_OPCODE_COUNT)
+        {
+            debug("Error: invalid bytecode opcode (%d).\n", inst.opcode);
+            exit(1);
+        }
+        threaded[i].handler = handlers[inst.opcode];
+        threaded[i].a = inst.a;
+        threaded[i].b = inst.b;
+        threaded[i].c = inst.c;
+    }
+}
+
+void execute_threaded(const BytecodeProgram & bytecode, ExecutionContext & context)
+{
+    vector<int> frame(bytecode.frame_image);
+    int * mem = frame.empty() ? context.mem : frame.data();
+    static const void * const handlers[BC_OPCODE_COUNT] = {
+        &&op_noop, &&op_in, &&op_out,
+        &&op_assign_mov, &&op_assign_add, &&op_assign_sub, &&op_assign_mult, &&op_assign_div,
+        &&op_cjmp_greater, &&op_cjmp_less, &&op_cjmp_notequal,
+        &&op_cjmp_equal, &&op_cjmp_greater_equal, &&op_cjmp_less_equal,
+        &&op_jmp, &&op_halt,
+        &&op_assign_mov_imm, &&op_assign_add_imm, &&op_assign_sub_imm,
+        &&op_assign_mult_imm, &&op_assign_div_imm,
+        &&op_cjmp_greater_imm, &&op_cjmp_less_imm, &&op_cjmp_notequal_imm,
+        &&op_cjmp_equal_imm, &&op_cjmp_greater_equal_imm, &&op_cjmp_less_equal_imm,
+        &&op_switch_table, &&op_switch_search,
+        &&op_add_imm_jmp, &&op_add_imm_loop_less_imm, &&op_jmp_less, &&op_jmp_less_imm,
+        &&op_cjmp_greater_imm_add_imm, &&op_cjmp_less_imm_add_imm, &&op_in_in, &&op_out_out,
+        &&op_sub_imm_jmp, &&op_sub_imm_loop_greater_imm, &&op_jmp_greater, &&op_jmp_greater_imm
+    };
+
+    // Replace every opcode with the address of its handler, once per
+    // program, so that dispatch is a single indirect jump at the end of
+    // each handler
+    EngineCode & engine_code = *bytecode.engine_code;
+    call_once(engine_code.threaded_once, thread_code, cref(bytecode), handlers,
+              ref(engine_code.threaded));
+
+    const ThreadedInstruction * code = engine_code.threaded.data();
+    const ThreadedInstruction * ip = code;
+    const SwitchTable * switches = bytecode.switches.data();
+
+#define DISPATCH() goto *ip->handler
+#define NEXT() do { ip++; DISPATCH(); } while (0)
+
+    DISPATCH();
+
+op_noop:
+    NEXT();
+op_in:
+    mem[ip->a] = context.NextInput();
+    if (context.error != NULL)
+        return;
+    NEXT();
+op_out:
+    context.output->WriteInt(mem[ip->a]);
+    NEXT();
+op_assign_mov:
+    mem[ip->a] = mem[ip->b];
+    NEXT();
+op_assign_add:
+    mem[ip->a] = mem[ip->b] + mem[ip->c];
+    NEXT();
+op_assign_sub:
+    mem[ip->a] = mem[ip->b] - mem[ip->c];
+    NEXT();
+op_assign_mult:
+    mem[ip->a] = mem[ip->b] * mem[ip->c];
+    NEXT();
+op_assign_div:
+    mem[ip->a] = mem[ip->b] / mem[ip->c];
+    NEXT();
+op_cjmp_greater:
+    ip = (mem[ip->b] > mem[ip->c]) ? ip + 1 : code + ip->a;
+    DISPATCH();
+op_cjmp_less:
+    ip = (mem[ip->b] < mem[ip->c]) ? ip + 1 : code + ip->a;
+    DISPATCH();
+op_cjmp_notequal:
+    ip = (mem[ip->b] != mem[ip->c]) ? ip + 1 : code + ip->a;
+    DISPATCH();
+op_cjmp_equal:
+    ip = (mem[ip->b] == mem[ip->c]) ? ip + 1 : code + ip->a;
+    DISPATCH();
+op_cjmp_greater_equal:
+    ip = (mem[ip->b] >= mem[ip->c]) ? ip + 1 : code + ip->a;
+    DISPATCH();
+op_cjmp_less_equal:
+    ip = (mem[ip->b] <= mem[ip->c]) ? ip + 1 : code + ip->a;
+    DISPATCH();
+op_jmp:
+    ip = code + ip->a;
+    DISPATCH();
+op_halt:
+    return;
+op_assign_mov_imm:
+    mem[ip->a] = (int) ip->b;
+    NEXT();
+op_assign_add_imm:
+    mem[ip->a] = mem[ip->b] + (int) ip->c;
+    NEXT();
+op_assign_sub_imm:
+    mem[ip->a] = mem[ip->b] - (int) ip->c;
+    NEXT();
+op_assign_mult_imm:
+    mem[ip->a] = mem[ip->b] * (int) ip->c;
+    NEXT();
+op_assign_div_imm:
+    mem[ip->a] = mem[ip->b] / (int) ip->c;
+    NEXT();
+op_cjmp_greater_imm:
+    ip = (mem[ip->b] > (int) ip->c) ? ip + 1 : code + ip->a;
+    DISPATCH();
+op_cjmp_less_imm:
+    ip = (mem[ip->b] < (int) ip->c) ? ip + 1 : code + ip->a;
+    DISPATCH();
+op_cjmp_notequal_imm:
+    ip = (mem[ip->b] != (int) ip->c) ? ip + 1 : code + ip->a;
+    DISPATCH();
+op_cjmp_equal_imm:
+    ip = (mem[ip->b] == (int) ip->c) ? ip + 1 : code + ip->a;
+    DISPATCH();
+op_cjmp_greater_equal_imm:
+    ip = (mem[ip->b] >= (int) ip->c) ? ip + 1 : code + ip->a;
+    DISPATCH();
+op_cjmp_less_equal_imm:
+    ip = (mem[ip->b] <= (int) ip->c) ? ip + 1 : code + ip->a;
+    DISPATCH();
+op_switch_table:
+    ip = code + table_target(switches[ip->a], mem[ip->b], ip->c);
+    DISPATCH();
+op_switch_search:
+    ip = code + search_target(switches[ip->a], mem[ip->b], ip->c);
+    DISPATCH();
+op_add_imm_jmp:
+    mem[ip->a] = mem[ip->b] + (int) ip->c;
+    ip = code + ip[1].a;
+    DISPATCH();
+op_add_imm_loop_less_imm:
+    mem[ip->a] = mem[ip->b] + (int) ip->c;
+    ip = code + ip[1].a;
+    ip = (mem[ip->b] < (int) ip->c) ? ip + 1 : code + ip->a;
+    DISPATCH();
+op_jmp_less:
+    ip = code + ip->a;
+    ip = (mem[ip->b] < mem[ip->c]) ? ip + 1 : code + ip->a;
+    DISPATCH();
+op_jmp_less_imm:
+    ip = code + ip->a;
+    ip = (mem[ip->b] < (int) ip->c) ? ip + 1 : code + ip->a;
+    DISPATCH();
+op_cjmp_greater_imm_add_imm:
+    if (mem[ip->b] <= (int) ip->c)
+    {
+        ip = code + ip->a;
+        DISPATCH();
+    }
+    mem[ip[1].a] = mem[ip[1].b] + (int) ip[1].c;
+    ip += 2;
+    DISPATCH();
+op_cjmp_less_imm_add_imm:
+    if (mem[ip->b] >= (int) ip->c)
+    {
+        ip = code + ip->a;
+        DISPATCH();
+    }
+    mem[ip[1].a] = mem[ip[1].b] + (int) ip[1].c;
+    ip += 2;
+    DISPATCH();
+op_in_in:
+    mem[ip->a] = context.NextInput();
+    if (context.error != NULL)
+        return;
+    mem[ip[1].a] = context.NextInput();
+    if (context.error != NULL)
+        return;
+    ip += 2;
+    DISPATCH();
+op_out_out:
+    context.output->WriteInt(mem[ip->a]);
+    context.output->WriteInt(mem[ip[1].a]);
+    ip += 2;
+    DISPATCH();
+op_sub_imm_jmp:
+    mem[ip->a] = mem[ip->b] - (int) ip->c;
+    ip = code + ip[1].a;
+    DISPATCH();
+op_sub_imm_loop_greater_imm:
+    mem[ip->a] = mem[ip->b] - (int) ip->c;
+    ip = code + ip[1].a;
+    ip = (mem[ip->b] > (int) ip->c) ? ip + 1 : code + ip->a;
+    DISPATCH();
+op_jmp_greater:
+    ip = code + ip->a;
+    ip = (mem[ip->b] > mem[ip->c]) ? ip + 1 : code + ip->a;
+    DISPATCH();
+op_jmp_greater_imm:
+    ip = code + ip->a;
+    ip = (mem[ip->b] > (int) ip->c) ? ip + 1 : code + ip->a;
+    DISPATCH();
+
+#undef NEXT
+#undef DISPATCH
+}
+
+#else
+
+void execute_threaded(const BytecodeProgram & bytecode, ExecutionContext & context)
+{
+    execute_bytecode(bytecode, context);
+}
+
+#endif
+
+void execute_with_engine(ExecutionEngine engine, const CompiledProgram & program,
+                         const BytecodeProgram & bytecode, ExecutionContext & context)
+{
+    switch (engine)
+    {
+        case ENGINE_REFERENCE:
+            execute_program(program.head, context);
+            break;
+        case ENGINE_SWITCH:
+            execute_bytecode(bytecode, context);
+            break;
+        case ENGINE_REGISTER:
+            execute_threaded(bytecode, context);
+            break;
+        case ENGINE_JIT:
+            execute_jit(bytecode, context);
+            break;
+        default:
+            execute_threaded(bytecode, context);
+            break;
+    }
+}
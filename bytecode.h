@@ -0,0 +1,229 @@
+#ifndef _BYTECODE_H_
+#define _BYTECODE_H_
+
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "compiler.h"
+
+/*
+ * ASSIGN and CJMP are pre-decoded into one opcode per operator so that the
+ * interpreters dispatch once per instruction. The _IMM forms carry their
+ * last operand as an immediate taken from the constant pool instead of a
+ * mem[] index.
+ */
+enum BytecodeOpcode : uint8_t {
+    BC_NOOP,
+    BC_IN,
+    BC_OUT,
+    BC_ASSIGN_MOV,
+    BC_ASSIGN_ADD,
+    BC_ASSIGN_SUB,
+    BC_ASSIGN_MULT,
+    BC_ASSIGN_DIV,
+    BC_CJMP_GREATER,
+    BC_CJMP_LESS,
+    BC_CJMP_NOTEQUAL,
+    BC_CJMP_EQUAL,
+    BC_CJMP_GREATER_EQUAL,
+    BC_CJMP_LESS_EQUAL,
+    BC_JMP,
+    BC_HALT,
+    BC_ASSIGN_MOV_IMM,
+    BC_ASSIGN_ADD_IMM,
+    BC_ASSIGN_SUB_IMM,
+    BC_ASSIGN_MULT_IMM,
+    BC_ASSIGN_DIV_IMM,
+    BC_CJMP_GREATER_IMM,
+    BC_CJMP_LESS_IMM,
+    BC_CJMP_NOTEQUAL_IMM,
+    BC_CJMP_EQUAL_IMM,
+    BC_CJMP_GREATER_EQUAL_IMM,
+    BC_CJMP_LESS_EQUAL_IMM,
+    BC_SWITCH_TABLE,
+    BC_SWITCH_SEARCH,
+
+    /*
+     * Superinstructions, see fuse_superinstructions(). Each one stands for
+     * the instruction it replaces followed by what that instruction leads
+     * to, and reads the operands of both from their own records.
+     */
+    BC_ADD_IMM_JMP,                 // ASSIGN_ADD_IMM, JMP
+    BC_ADD_IMM_LOOP_LESS_IMM,       // ASSIGN_ADD_IMM, JMP, CJMP_LESS_IMM at its target
+    BC_JMP_LESS,                    // JMP, CJMP_LESS at its target
+    BC_JMP_LESS_IMM,                // JMP, CJMP_LESS_IMM at its target
+    BC_CJMP_GREATER_IMM_ADD_IMM,    // CJMP_GREATER_IMM, ASSIGN_ADD_IMM when it falls through
+    BC_CJMP_LESS_IMM_ADD_IMM,       // CJMP_LESS_IMM, ASSIGN_ADD_IMM when it falls through
+    BC_IN_IN,                       // IN, IN
+    BC_OUT_OUT,                     // OUT, OUT
+    BC_SUB_IMM_JMP,                 // ASSIGN_SUB_IMM, JMP
+    BC_SUB_IMM_LOOP_GREATER_IMM,    // ASSIGN_SUB_IMM, JMP, CJMP_GREATER_IMM at its target
+    BC_JMP_GREATER,                 // JMP, CJMP_GREATER at its target
+    BC_JMP_GREATER_IMM,             // JMP, CJMP_GREATER_IMM at its target
+    BC_OPCODE_COUNT
+};
+
+/*
+ * Flat encoding of one InstructionNode. Operands are memory frame indices and jump
+ * targets are offsets into BytecodeProgram::code, so execution falls through
+ * with pc++ instead of following next pointers.
+ *
+ *   ASSIGN_*  a = left hand side, b = operand1, c = operand2
+ *   CJMP_*    a = target, b = operand1, c = operand2
+ *   JMP       a = target
+ *   IN/OUT    a = var index
+ *   SWITCH_*  a = BytecodeProgram::switches index, b = operand, c = target
+ *             when no case matches
+ *
+ * ASSIGN_MOV_IMM keeps its immediate in b; every other _IMM opcode keeps it
+ * in c. Immediates are stored as the bit pattern of the int value.
+ */
+struct BytecodeInstruction
+{
+    uint8_t opcode;
+    uint8_t reserved[3];
+    uint32_t a;
+    uint32_t b;
+    uint32_t c;
+};
+
+static_assert(sizeof(BytecodeInstruction) == 16, "BytecodeInstruction must stay 16 bytes");
+
+/*
+ * Multiway branch that replaces a run of CJMP_NOTEQUAL_IMM on one operand,
+ * i.e. what a SWITCH statement lowers to. SWITCH_TABLE indexes targets by
+ * operand - low; SWITCH_SEARCH looks the operand up in keys, which are
+ * sorted, and takes the target at the same position. A case value listed
+ * twice keeps the target of its first test, as the chain does.
+ */
+struct SwitchTable
+{
+    int32_t low;
+    std::vector<int32_t> keys;
+    std::vector<uint32_t> targets;
+};
+
+// One instruction of execute_threaded(): the address of its handler in
+// place of the opcode
+struct ThreadedInstruction
+{
+    const void * handler;
+    uint32_t a;
+    uint32_t b;
+    uint32_t c;
+};
+
+/*
+ * What the threaded and JIT engines make of a program. Each form is built
+ * by the first execution that needs it and shared by every later one,
+ * including the concurrent executions of a batch. native is NULL when the
+ * program could not be translated.
+ */
+struct EngineCode
+{
+    EngineCode() : native(NULL), native_length(0) {}
+    ~EngineCode();
+
+    std::once_flag threaded_once;
+    std::vector<ThreadedInstruction> threaded;
+    std::once_flag native_once;
+    void * native;
+    size_t native_length;
+};
+
+/*
+ * frame_image is empty when operands index the program's memory frame.
+ * Otherwise the code runs on a private frame of its own, initialized from
+ * frame_image, as compile_registers() lays it out. The code must not change
+ * once it has been executed, since engine_code is derived from it.
+ */
+struct BytecodeProgram
+{
+    BytecodeProgram() : engine_code(new EngineCode) {}
+
+    std::vector<BytecodeInstruction> code;
+    std::vector<int> frame_image;
+    std::vector<SwitchTable> switches;
+    std::unique_ptr<EngineCode> engine_code;
+};
+
+/*
+ * Runs with fewer tests than this stay chains. A table is used when at
+ * least one in SWITCH_TABLE_DENSITY of the values it spans are cases.
+ */
+#define SWITCH_MIN_CASES 4
+#define SWITCH_TABLE_DENSITY 2
+
+// Lays the InstructionNode graph out as a contiguous array. Chains that are
+// only reachable through a jump target are appended after the main chain and
+// end in an explicit JMP or HALT.
+void compile_bytecode(const CompiledProgram & program, BytecodeProgram & bytecode);
+
+// Turns every run of at least SWITCH_MIN_CASES CJMP_NOTEQUAL_IMM on the same
+// operand into a SWITCH_* at the head of the run. The tests after the head
+// stay where they are, so jumps into the middle of a run keep working.
+void lower_switches(BytecodeProgram & bytecode);
+
+/*
+ * Gives the first instruction of each pair that loops and conditionals
+ * execute most often the opcode of a superinstruction that runs the pair
+ * with one dispatch: the latch of a WHILE or FOR together with the test at
+ * its header, an IF whose body is a single increment, and runs of IN or
+ * OUT. The second instruction keeps its record, so jumps to it are
+ * unaffected. profile_opcode_pairs() shows which pairs a program executes.
+ */
+void fuse_superinstructions(BytecodeProgram & bytecode);
+
+// The opcode a superinstruction begins with; any other opcode unchanged
+BytecodeOpcode unfused_opcode(uint8_t opcode);
+
+// Sets the opcode of an ASSIGN or CJMP whose operands a, b and c are already
+// frame indices, switching to the _IMM form when is_constant says the last
+// operand is a constant whose value image holds
+void encode_operation(InstructionNode * node, const std::vector<bool> & is_constant,
+                      const std::vector<int> & image, BytecodeInstruction & inst);
+
+/*
+ * Register form: the program is put in SSA form and every web of values a
+ * variable takes (one SSA value together with the phis joining it) gets a
+ * location chosen by a linear scan register allocator. Locations are the
+ * REGISTER_COUNT registers at the bottom of a private frame and spill slots
+ * above them; constants that cannot become immediates follow the spill slots.
+ * Slots that only ever held separate temporaries end up sharing a register,
+ * so the frame is a small fraction of the memory image.
+ */
+#define REGISTER_COUNT 16
+
+void compile_registers(CompiledProgram & program, BytecodeProgram & bytecode);
+
+enum ExecutionEngine {
+    ENGINE_REFERENCE,   // execute_program() over the InstructionNode list
+    ENGINE_SWITCH,      // execute_bytecode()
+    ENGINE_THREADED,    // execute_threaded()
+    ENGINE_REGISTER,    // execute_threaded() over compile_registers() code
+    ENGINE_JIT          // execute_jit()
+};
+
+void execute_bytecode(const BytecodeProgram & bytecode, ExecutionContext & context);
+
+// Runs the program like execute_bytecode() while counting every pair of
+// consecutive opcodes, then writes the most frequent pairs to report
+void profile_opcode_pairs(const BytecodeProgram & bytecode, ExecutionContext & context,
+                          FILE * report);
+
+// Direct-threaded interpreter. Falls back to execute_bytecode() when the
+// compiler does not support computed goto.
+void execute_threaded(const BytecodeProgram & bytecode, ExecutionContext & context);
+
+// Translates the bytecode to x86-64 machine code in an executable mapping
+// and runs it. Falls back to execute_threaded() on other hosts or when the
+// mapping cannot be made.
+void execute_jit(const BytecodeProgram & bytecode, ExecutionContext & context);
+
+void execute_with_engine(ExecutionEngine engine, const CompiledProgram & program,
+                         const BytecodeProgram & bytecode, ExecutionContext & context);
+
+#endif /* _BYTECODE_H_ */
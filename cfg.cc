@@ -0,0 +1,793 @@
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "cfg.h"
+
+using namespace std;
+
+static InstructionNode* jump_target(InstructionNode* node)
+{
+    if (node->type == CJMP)
+        return node->cjmp_inst.target;
+    if (node->type == JMP)
+        return node->jmp_inst.target;
+    return NULL;
+}
+
+static void set_jump_target(InstructionNode* node, InstructionNode* target)
+{
+    if (node->type == CJMP)
+        node->cjmp_inst.target = target;
+    else
+        node->jmp_inst.target = target;
+}
+
+#define NODE_INDEX_INITIAL_SIZE 64
+
+/*
+ * Maps instruction nodes to their position while a program is linearized.
+ * Open addressing on the node address, like SymbolTable; a node-keyed
+ * unordered_map made this the dominant cost on large programs.
+ */
+class NodeIndex {
+  public:
+    // Sized so that expected nodes fit without growing
+    explicit NodeIndex(size_t expected);
+
+    void Insert(InstructionNode * node, int position);
+    // Position of node, -1 if it was never inserted
+    int Find(InstructionNode * node) const;
+
+  private:
+    struct Entry {
+        InstructionNode * node;
+        int position;
+    };
+
+    void Grow();
+
+    vector<Entry> entries;
+    size_t used;
+};
+
+static size_t hash_node(InstructionNode * node)
+{
+    uint64_t key = (uint64_t) (uintptr_t) node;
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;       // murmur3 finalizer
+    key ^= key >> 33;
+    return (size_t) key;
+}
+
+NodeIndex::NodeIndex(size_t expected) : used(0)
+{
+    size_t size = NODE_INDEX_INITIAL_SIZE;
+    while (size < expected * 2 + 2)
+        size *= 2;
+    Entry empty = { NULL, -1 };
+    entries.assign(size, empty);
+}
+
+void NodeIndex::Insert(InstructionNode * node, int position)
+{
+    size_t mask = entries.size() - 1;
+    for (size_t i = hash_node(node) & mask; ; i = (i + 1) & mask) {
+        if (entries[i].node == node) {
+            entries[i].position = position;
+            return;
+        }
+        if (entries[i].node == NULL) {
+            entries[i].node = node;
+            entries[i].position = position;
+            if (++used * 2 > entries.size())
+                Grow();
+            return;
+        }
+    }
+}
+
+int NodeIndex::Find(InstructionNode * node) const
+{
+    size_t mask = entries.size() - 1;
+    for (size_t i = hash_node(node) & mask; ; i = (i + 1) & mask) {
+        if (entries[i].node == node)
+            return entries[i].position;
+        if (entries[i].node == NULL)
+            return -1;
+    }
+}
+
+void NodeIndex::Grow()
+{
+    vector<Entry> old;
+    old.swap(entries);
+    Entry empty = { NULL, -1 };
+    entries.assign(old.size() * 2, empty);
+    size_t mask = entries.size() - 1;
+    for (size_t k = 0; k < old.size(); k++) {
+        if (old[k].node == NULL)
+            continue;
+        size_t i = hash_node(old[k].node) & mask;
+        while (entries[i].node != NULL)
+            i = (i + 1) & mask;
+        entries[i] = old[k];
+    }
+}
+
+void linearize_program(CompiledProgram & program, LinearCode & linear)
+{
+    vector<InstructionNode*> & code = linear.code;
+    NodeIndex placed(program.arena.Count());
+    vector<InstructionNode*> pending;
+    InstructionNode* exit_node = NULL;
+    bool open_end = false;      // the last chain laid out falls off its end
+
+    code.clear();
+    pending.push_back(program.head);
+    while (!pending.empty())
+    {
+        InstructionNode* node = pending.back();
+        pending.pop_back();
+        if (node == NULL || placed.Find(node) >= 0)
+            continue;
+
+        // A chain is about to follow one that halts; route the halt to a
+        // NOOP at the very end instead of falling into the new chain
+        if (open_end)
+        {
+            if (exit_node == NULL)
+                exit_node = program.arena.NewInstruction(NOOP);
+            InstructionNode* jump = program.arena.NewInstruction(JMP);
+            jump->jmp_inst.target = exit_node;
+            code.push_back(jump);
+        }
+
+        while (node != NULL && placed.Find(node) < 0)
+        {
+            placed.Insert(node, code.size());
+            code.push_back(node);
+            InstructionNode* target = jump_target(node);
+            if (target != NULL)
+                pending.push_back(target);
+            node = node->next;
+        }
+
+        if (node != NULL)
+        {
+            InstructionNode* jump = program.arena.NewInstruction(JMP);
+            jump->line_no = node->line_no;
+            jump->jmp_inst.target = node;
+            code.push_back(jump);
+            open_end = false;
+        }
+        else
+        {
+            open_end = code.back()->type != JMP;
+        }
+    }
+
+    if (exit_node != NULL)
+    {
+        placed.Insert(exit_node, code.size());
+        code.push_back(exit_node);
+    }
+
+    linear.target.assign(code.size(), -1);
+    for (size_t i = 0; i < code.size(); i++)
+    {
+        InstructionNode* target = jump_target(code[i]);
+        if (target != NULL)
+            linear.target[i] = placed.Find(target);
+    }
+}
+
+void remove_instructions(CompiledProgram & program, LinearCode & linear,
+                         const vector<bool> & removed)
+{
+    int n = linear.code.size();
+
+    // survivor[k] is the first surviving instruction at or after k, and
+    // position[k] where a surviving k ends up
+    vector<int> survivor(n + 1, n);
+    for (int k = n - 1; k >= 0; k--)
+        survivor[k] = removed[k] ? survivor[k + 1] : k;
+    vector<int> position(n + 1);
+    int kept = 0;
+    for (int k = 0; k < n; k++)
+        if (!removed[k])
+            position[k] = kept++;
+    position[n] = kept;         // an exit NOOP appended after the survivors
+
+    bool needs_exit = false;
+    LinearCode result;
+    result.code.reserve(kept + 1);
+    result.target.reserve(kept + 1);
+    for (int i = 0; i < n; i++)
+    {
+        if (removed[i])
+            continue;
+        int target = linear.target[i];
+        if (target >= 0)
+        {
+            target = position[survivor[target]];
+            needs_exit = needs_exit || target == kept;
+        }
+        result.code.push_back(linear.code[i]);
+        result.target.push_back(target);
+    }
+    if (needs_exit)
+    {
+        result.code.push_back(program.arena.NewInstruction(NOOP));
+        result.target.push_back(-1);
+    }
+
+    linear.code.swap(result.code);
+    linear.target.swap(result.target);
+}
+
+void store_program(CompiledProgram & program, const LinearCode & linear)
+{
+    const vector<InstructionNode*> & code = linear.code;
+    for (size_t i = 0; i < code.size(); i++)
+    {
+        if (linear.target[i] >= 0)
+            set_jump_target(code[i], code[linear.target[i]]);
+        code[i]->next = (i + 1 < code.size()) ? code[i + 1] : NULL;
+    }
+    program.head = code.empty() ? NULL : code[0];
+}
+
+int instruction_reads(InstructionNode * node, int reads[2])
+{
+    switch (node->type)
+    {
+        case ASSIGN:
+            reads[0] = node->assign_inst.operand1_index;
+            if (node->assign_inst.op == OPERATOR_NONE)
+                return 1;
+            reads[1] = node->assign_inst.operand2_index;
+            return 2;
+        case OUT:
+            reads[0] = node->output_inst.var_index;
+            return 1;
+        case CJMP:
+            reads[0] = node->cjmp_inst.operand1_index;
+            reads[1] = node->cjmp_inst.operand2_index;
+            return 2;
+        default:
+            return 0;
+    }
+}
+
+int instruction_writes(InstructionNode * node)
+{
+    if (node->type == ASSIGN)
+        return node->assign_inst.left_hand_side_index;
+    if (node->type == IN)
+        return node->input_inst.var_index;
+    return -1;
+}
+
+void ControlFlowGraph::Build(const LinearCode & linear)
+{
+    const vector<InstructionNode*> & code = linear.code;
+    int n = code.size();
+
+    // Blocks start at jump targets and after jumps
+    vector<bool> leader(n + 1, false);
+    leader[0] = true;
+    for (int i = 0; i < n; i++)
+    {
+        if (linear.target[i] >= 0)
+        {
+            leader[linear.target[i]] = true;
+            leader[i + 1] = true;
+        }
+    }
+    vector<int> block_of(n, -1);
+    vector<int> begin;
+    for (int i = 0; i < n; i++)
+    {
+        if (leader[i])
+            begin.push_back(i);
+        block_of[i] = begin.size() - 1;
+    }
+    begin.push_back(n);
+
+    // An empty program is one empty block that halts
+    int count = (n == 0) ? 1 : begin.size() - 1;
+    blocks.assign(count, BasicBlock());
+    layout_next.resize(count);
+    for (int b = 0; b < count; b++)
+    {
+        layout_next[b] = (b + 1 < count) ? b + 1 : -1;
+        BasicBlock & block = blocks[b];
+        block.branch = NULL;
+        block.next = -1;
+        block.target = -1;
+        if (n == 0)
+            break;
+
+        int end = begin[b + 1];
+        bool jumps = false;
+        for (int i = begin[b]; i < end; i++)
+        {
+            InstructionNode* node = code[i];
+            if (node->type == NOOP)
+                continue;
+            if (node->type == JMP)
+            {
+                block.next = block_of[linear.target[i]];
+                jumps = true;
+            }
+            else if (node->type == CJMP)
+            {
+                block.branch = node;
+                block.target = block_of[linear.target[i]];
+            }
+            else
+            {
+                block.code.push_back(node);
+            }
+        }
+        if (!jumps && end < n)
+            block.next = b + 1;
+    }
+    Connect();
+}
+
+void ControlFlowGraph::Connect()
+{
+    int count = blocks.size();
+    for (int b = 0; b < count; b++)
+    {
+        BasicBlock & block = blocks[b];
+        block.successors.clear();
+        block.predecessors.clear();
+        block.reachable = false;
+        if (block.next >= 0)
+            block.successors.push_back(block.next);
+        if (block.branch != NULL && block.target >= 0 && block.target != block.next)
+            block.successors.push_back(block.target);
+    }
+
+    // Iterative depth-first search from the entry for the postorder
+    vector<int> postorder;
+    vector< pair<int, int> > stack;     // block, next successor to visit
+    blocks[0].reachable = true;
+    stack.push_back(make_pair(0, 0));
+    while (!stack.empty())
+    {
+        int b = stack.back().first;
+        int k = stack.back().second;
+        if (k < (int) blocks[b].successors.size())
+        {
+            stack.back().second++;
+            int s = blocks[b].successors[k];
+            if (!blocks[s].reachable)
+            {
+                blocks[s].reachable = true;
+                stack.push_back(make_pair(s, 0));
+            }
+        }
+        else
+        {
+            postorder.push_back(b);
+            stack.pop_back();
+        }
+    }
+    reverse_postorder.assign(postorder.rbegin(), postorder.rend());
+
+    for (int b = 0; b < count; b++)
+    {
+        if (!blocks[b].reachable)
+            continue;
+        for (size_t k = 0; k < blocks[b].successors.size(); k++)
+            blocks[blocks[b].successors[k]].predecessors.push_back(b);
+    }
+}
+
+/*
+ * Cooper, Harvey and Kennedy's iterative algorithm. order is a reverse
+ * postorder of the nodes reachable from order[0], predecessors the incoming
+ * edges of every node. idom[node] is -1 for nodes not in order.
+ */
+static void compute_idom(const vector<int> & order, const vector< vector<int> > & predecessors,
+                         vector<int> & idom)
+{
+    vector<int> number(predecessors.size(), -1);
+    for (size_t k = 0; k < order.size(); k++)
+        number[order[k]] = k;
+
+    idom.assign(predecessors.size(), -1);
+    idom[order[0]] = order[0];
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+        for (size_t k = 1; k < order.size(); k++)
+        {
+            int node = order[k];
+            int new_idom = -1;
+            for (size_t p = 0; p < predecessors[node].size(); p++)
+            {
+                int other = predecessors[node][p];
+                if (number[other] < 0 || idom[other] < 0)
+                    continue;
+                if (new_idom < 0)
+                {
+                    new_idom = other;
+                    continue;
+                }
+                // Walk both up the tree until they meet
+                int a = other, b = new_idom;
+                while (a != b)
+                {
+                    while (number[a] > number[b])
+                        a = idom[a];
+                    while (number[b] > number[a])
+                        b = idom[b];
+                }
+                new_idom = a;
+            }
+            if (idom[node] != new_idom)
+            {
+                idom[node] = new_idom;
+                changed = true;
+            }
+        }
+    }
+}
+
+bool ControlFlowGraph::Analyze(long long max_loop_blocks)
+{
+    ComputeDominators();
+    ComputePostDominators();
+    return FindLoops(max_loop_blocks);
+}
+
+void ControlFlowGraph::ComputeDominators()
+{
+    int count = blocks.size();
+    vector< vector<int> > predecessors(count);
+    for (int b = 0; b < count; b++)
+        predecessors[b] = blocks[b].predecessors;
+
+    vector<int> idom;
+    compute_idom(reverse_postorder, predecessors, idom);
+
+    // Number the dominator tree in depth-first order
+    vector< vector<int> > children(count);
+    for (int b = 0; b < count; b++)
+    {
+        blocks[b].idom = idom[b];
+        if (idom[b] >= 0 && idom[b] != b)
+            children[idom[b]].push_back(b);
+    }
+    dom_enter.assign(count, -1);
+    dom_exit.assign(count, -1);
+    int clock = 0;
+    vector< pair<int, int> > stack;
+    stack.push_back(make_pair(0, 0));
+    dom_enter[0] = clock++;
+    while (!stack.empty())
+    {
+        int b = stack.back().first;
+        int k = stack.back().second;
+        if (k < (int) children[b].size())
+        {
+            stack.back().second++;
+            int child = children[b][k];
+            dom_enter[child] = clock++;
+            stack.push_back(make_pair(child, 0));
+        }
+        else
+        {
+            dom_exit[b] = clock++;
+            stack.pop_back();
+        }
+    }
+}
+
+// Post-dominators are dominators of the reversed graph, rooted at a virtual
+// exit node that every halting block leads to
+void ControlFlowGraph::ComputePostDominators()
+{
+    int count = blocks.size();
+    int exit_node = count;
+    vector< vector<int> > reverse_successors(count + 1);
+    vector< vector<int> > reverse_predecessors(count + 1);
+    for (int b = 0; b < count; b++)
+    {
+        if (!blocks[b].reachable)
+            continue;
+        bool halts = blocks[b].next < 0 || (blocks[b].branch != NULL && blocks[b].target < 0);
+        if (halts)
+        {
+            reverse_successors[exit_node].push_back(b);
+            reverse_predecessors[b].push_back(exit_node);
+        }
+        for (size_t k = 0; k < blocks[b].successors.size(); k++)
+        {
+            int s = blocks[b].successors[k];
+            reverse_successors[s].push_back(b);
+            reverse_predecessors[b].push_back(s);
+        }
+    }
+
+    vector<int> postorder;
+    vector<bool> seen(count + 1, false);
+    vector< pair<int, int> > stack;
+    seen[exit_node] = true;
+    stack.push_back(make_pair(exit_node, 0));
+    while (!stack.empty())
+    {
+        int b = stack.back().first;
+        int k = stack.back().second;
+        if (k < (int) reverse_successors[b].size())
+        {
+            stack.back().second++;
+            int s = reverse_successors[b][k];
+            if (!seen[s])
+            {
+                seen[s] = true;
+                stack.push_back(make_pair(s, 0));
+            }
+        }
+        else
+        {
+            postorder.push_back(b);
+            stack.pop_back();
+        }
+    }
+    vector<int> order(postorder.rbegin(), postorder.rend());
+
+    vector<int> ipdom;
+    compute_idom(order, reverse_predecessors, ipdom);
+    for (int b = 0; b < count; b++)
+        blocks[b].ipdom = (ipdom[b] == exit_node) ? -1 : ipdom[b];
+}
+
+bool ControlFlowGraph::Dominates(int a, int b) const
+{
+    if (dom_enter[a] < 0 || dom_enter[b] < 0)
+        return false;
+    return dom_enter[a] <= dom_enter[b] && dom_exit[b] <= dom_exit[a];
+}
+
+static bool larger_loop(const NaturalLoop & a, const NaturalLoop & b)
+{
+    return a.blocks.size() > b.blocks.size();
+}
+
+bool ControlFlowGraph::FindLoops(long long max_loop_blocks)
+{
+    int count = blocks.size();
+    loops.clear();
+
+    // A back edge goes to a block that dominates its source
+    vector<int> loop_of_header(count, -1);
+    for (size_t k = 0; k < reverse_postorder.size(); k++)
+    {
+        int b = reverse_postorder[k];
+        for (size_t s = 0; s < blocks[b].successors.size(); s++)
+        {
+            int header = blocks[b].successors[s];
+            if (!Dominates(header, b))
+                continue;
+            if (loop_of_header[header] < 0)
+            {
+                loop_of_header[header] = loops.size();
+                NaturalLoop loop;
+                loop.header = header;
+                loop.parent = -1;
+                loop.depth = 1;
+                loops.push_back(loop);
+            }
+            loops[loop_of_header[header]].latches.push_back(b);
+        }
+    }
+
+    // A body lies in the dominator subtree of its header, whose size the
+    // tree numbering gives without listing it
+    long long bound = 0;
+    for (size_t l = 0; l < loops.size(); l++)
+        bound += (dom_exit[loops[l].header] - dom_enter[loops[l].header] + 1) / 2;
+    if (bound > max_loop_blocks)
+    {
+        loops.clear();
+        for (int b = 0; b < count; b++)
+            blocks[b].loop = -1;
+        return false;
+    }
+
+    // The body is everything that reaches a latch backwards without
+    // crossing the header
+    vector<int> mark(count, -1);
+    for (size_t l = 0; l < loops.size(); l++)
+    {
+        NaturalLoop & loop = loops[l];
+        vector<int> worklist;
+        mark[loop.header] = l;
+        loop.blocks.push_back(loop.header);
+        for (size_t k = 0; k < loop.latches.size(); k++)
+        {
+            int latch = loop.latches[k];
+            if (mark[latch] != (int) l)
+            {
+                mark[latch] = l;
+                loop.blocks.push_back(latch);
+                worklist.push_back(latch);
+            }
+        }
+        while (!worklist.empty())
+        {
+            int b = worklist.back();
+            worklist.pop_back();
+            for (size_t p = 0; p < blocks[b].predecessors.size(); p++)
+            {
+                int pred = blocks[b].predecessors[p];
+                if (mark[pred] != (int) l)
+                {
+                    mark[pred] = l;
+                    loop.blocks.push_back(pred);
+                    worklist.push_back(pred);
+                }
+            }
+        }
+        sort(loop.blocks.begin(), loop.blocks.end());
+    }
+
+    // Natural loops with different headers are nested or disjoint, so
+    // visiting larger loops first assigns every block its innermost loop
+    stable_sort(loops.begin(), loops.end(), larger_loop);
+    for (int b = 0; b < count; b++)
+        blocks[b].loop = -1;
+    for (size_t l = 0; l < loops.size(); l++)
+    {
+        NaturalLoop & loop = loops[l];
+        loop.parent = blocks[loop.header].loop;
+        loop.depth = (loop.parent < 0) ? 1 : loops[loop.parent].depth + 1;
+        for (size_t k = 0; k < loop.blocks.size(); k++)
+            blocks[loop.blocks[k]].loop = l;
+    }
+    return true;
+}
+
+int ControlFlowGraph::InsertBlock(int after)
+{
+    int b = blocks.size();
+    blocks.push_back(BasicBlock());
+    blocks[b].branch = NULL;
+    blocks[b].next = -1;
+    blocks[b].target = -1;
+    blocks[b].reachable = false;
+    blocks[b].idom = blocks[b].ipdom = blocks[b].loop = -1;
+    layout_next.push_back(layout_next[after]);
+    layout_next[after] = b;
+    return b;
+}
+
+// Line of the first instruction of block, 0 if it is empty
+static int block_line(const BasicBlock & block)
+{
+    if (!block.code.empty())
+        return block.code[0]->line_no;
+    return block.branch != NULL ? block.branch->line_no : 0;
+}
+
+void ControlFlowGraph::Lower(CompiledProgram & program, LinearCode & linear) const
+{
+    int count = blocks.size();
+    vector<int> order;
+    for (int b = 0; b >= 0; b = layout_next[b])
+        if (blocks[b].reachable)
+            order.push_back(b);
+
+    // Jump positions are patched once every block has its start; -1 stands
+    // for the end of the program
+    vector<int> start(count, -1);
+    vector< pair<int, int> > fixups;    // position, block
+    linear.code.clear();
+    linear.target.clear();
+
+    for (size_t k = 0; k < order.size(); k++)
+    {
+        const BasicBlock & block = blocks[order[k]];
+        int following = (k + 1 < order.size()) ? order[k + 1] : -1;
+
+        start[order[k]] = linear.code.size();
+        for (size_t i = 0; i < block.code.size(); i++)
+        {
+            linear.code.push_back(block.code[i]);
+            linear.target.push_back(-1);
+        }
+        if (block.branch != NULL)
+        {
+            fixups.push_back(make_pair((int) linear.code.size(), block.target));
+            linear.code.push_back(block.branch);
+            linear.target.push_back(-1);
+        }
+        if (block.next != following)
+        {
+            // Like the jumps the parser makes, it belongs to the statement it
+            // goes to: a loop's back edge to the loop
+            InstructionNode* jump = program.arena.NewInstruction(JMP);
+            if (block.next >= 0)
+                jump->line_no = block_line(blocks[block.next]);
+            if (jump->line_no == 0 && block.branch != NULL)
+                jump->line_no = block.branch->line_no;
+            else if (jump->line_no == 0 && !block.code.empty())
+                jump->line_no = block.code.back()->line_no;
+            fixups.push_back(make_pair((int) linear.code.size(), block.next));
+            linear.code.push_back(jump);
+            linear.target.push_back(-1);
+        }
+    }
+
+    int end = linear.code.size();
+    bool needs_exit = false;
+    for (size_t k = 0; k < fixups.size(); k++)
+    {
+        int block = fixups[k].second;
+        int position = (block < 0) ? end : start[block];
+        linear.target[fixups[k].first] = position;
+        needs_exit = needs_exit || position == end;
+    }
+    if (needs_exit)
+    {
+        linear.code.push_back(program.arena.NewInstruction(NOOP));
+        linear.target.push_back(-1);
+    }
+}
+
+int ControlFlowGraph::InstructionCount() const
+{
+    int count = 0;
+    for (size_t b = 0; b < blocks.size(); b++)
+        if (blocks[b].reachable)
+            count += blocks[b].code.size() + (blocks[b].branch != NULL);
+    return count;
+}
+
+void ControlFlowGraph::Print(FILE * out) const
+{
+    for (size_t k = 0; k < reverse_postorder.size(); k++)
+    {
+        int b = reverse_postorder[k];
+        const BasicBlock & block = blocks[b];
+        fprintf(out, "block %d: %d instructions", b, (int) block.code.size());
+        if (block.branch != NULL)
+            fprintf(out, ", CJMP true -> %d false -> %d", block.next, block.target);
+        else if (block.next >= 0)
+            fprintf(out, ", next %d", block.next);
+        else
+            fprintf(out, ", halts");
+        fprintf(out, "; idom %d, ipdom %d, loop %d\n", block.idom, block.ipdom, block.loop);
+    }
+    for (size_t l = 0; l < loops.size(); l++)
+    {
+        const NaturalLoop & loop = loops[l];
+        fprintf(out, "loop %d: header %d, depth %d, parent %d, latches", (int) l,
+                loop.header, loop.depth, loop.parent);
+        for (size_t k = 0; k < loop.latches.size(); k++)
+            fprintf(out, " %d", loop.latches[k]);
+        fprintf(out, ", blocks");
+        for (size_t k = 0; k < loop.blocks.size(); k++)
+            fprintf(out, " %d", loop.blocks[k]);
+        fprintf(out, "\n");
+    }
+}
+
+void dump_cfg(CompiledProgram & program, FILE * out)
+{
+    LinearCode linear;
+    ControlFlowGraph cfg;
+
+    linearize_program(program, linear);
+    cfg.Build(linear);
+    cfg.Analyze();
+    cfg.Print(out);
+}
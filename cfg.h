@@ -0,0 +1,142 @@
+#ifndef _CFG_H_
+#define _CFG_H_
+
+#include <climits>
+#include <cstdio>
+#include <vector>
+
+#include "compiler.h"
+
+/*
+ * A program laid out as one chain for the passes. target[i] is the position
+ * code[i] jumps to, or -1 when code[i] is not a jump. Passes edit positions
+ * and store_program() turns them back into pointers.
+ */
+struct LinearCode {
+    std::vector<InstructionNode*> code;
+    std::vector<int> target;
+};
+
+/*
+ * Lays program.head out in linear.code so that running off the end halts and
+ * every instruction that can fall through is followed by its successor.
+ * Chains that are only reachable through a jump target (SWITCH case bodies)
+ * are appended and closed with a JMP.
+ */
+void linearize_program(CompiledProgram & program, LinearCode & linear);
+
+/*
+ * Removes the instructions marked in removed. Jumps to a removed
+ * instruction go to the next surviving one, or to a NOOP appended at the end
+ * when nothing survives after it.
+ */
+void remove_instructions(CompiledProgram & program, LinearCode & linear,
+                         const std::vector<bool> & removed);
+
+// Writes linear back as program.head: next pointers follow code order and
+// jump targets follow target
+void store_program(CompiledProgram & program, const LinearCode & linear);
+
+// Stores the slots node reads in reads and returns how many there are
+int instruction_reads(InstructionNode * node, int reads[2]);
+
+// The slot node writes, -1 if it writes none
+int instruction_writes(InstructionNode * node);
+
+/*
+ * A maximal straight-line run of instructions. code holds everything but
+ * control transfers: unconditional jumps become the next edge and NOOP
+ * labels are dropped. When branch is a CJMP, control goes to next if its
+ * condition holds and to target otherwise; without one it always goes to
+ * next. An edge of -1 leaves the program, so a block whose next is -1 and
+ * which has no branch halts.
+ */
+struct BasicBlock {
+    std::vector<InstructionNode*> code;
+    InstructionNode * branch;
+    int next;
+    int target;
+
+    // Filled in by ControlFlowGraph::Connect()
+    std::vector<int> successors;
+    std::vector<int> predecessors;      // reachable predecessors only
+    bool reachable;
+
+    // Filled in by ControlFlowGraph::Analyze(); -1 where undefined
+    int idom;           // immediate dominator, the entry is its own
+    int ipdom;          // immediate post-dominator, -1 when it is the exit
+    int loop;           // innermost natural loop containing the block
+};
+
+/*
+ * A natural loop: header plus every block that reaches a latch (a block
+ * with a back edge to header) without passing through header. Loops sharing
+ * a header are merged, so loops are either disjoint or nested.
+ */
+struct NaturalLoop {
+    int header;
+    std::vector<int> latches;
+    std::vector<int> blocks;        // sorted, header included
+    int parent;                     // enclosing loop, -1 at top level
+    int depth;                      // 1 for a top-level loop
+};
+
+/*
+ * Control-flow graph of one program, built from its linear form. Block 0 is
+ * the entry. Passes edit blocks in place, call Connect() after changing
+ * edges and Analyze() when they need dominators or loops again, and finally
+ * Lower() the graph back to a linear instruction sequence.
+ */
+class ControlFlowGraph {
+  public:
+    void Build(const LinearCode & linear);
+
+    // Recomputes successors, predecessors, reachability and the reverse
+    // postorder from next, target and branch
+    void Connect();
+
+    // Computes dominators, post-dominators and natural loops. Requires an
+    // up to date Connect(). Listing loop bodies costs their total size, which
+    // deep nests make quadratic: when it could exceed max_loop_blocks no loops
+    // are found and false is returned.
+    bool Analyze(long long max_loop_blocks = LLONG_MAX);
+
+    // True if every path from the entry to b passes through a
+    bool Dominates(int a, int b) const;
+
+    // Adds an empty block that halts and places it right after block after
+    // in the layout. Returns its index.
+    int InsertBlock(int after);
+
+    /*
+     * Lays the reachable blocks out in layout order as linear code. A JMP is
+     * emitted only where the next block in the layout is not the successor,
+     * and a trailing NOOP only when something jumps past the last block.
+     */
+    void Lower(CompiledProgram & program, LinearCode & linear) const;
+
+    int InstructionCount() const;
+
+    // One line per reachable block and per loop, for --dump-cfg
+    void Print(FILE * out) const;
+
+    std::vector<BasicBlock> blocks;
+    std::vector<int> layout_next;           // block Lower() emits after each, -1 last
+    std::vector<int> reverse_postorder;     // reachable blocks only
+    std::vector<NaturalLoop> loops;         // outer loops before inner ones
+
+  private:
+    void ComputeDominators();
+    void ComputePostDominators();
+    bool FindLoops(long long max_loop_blocks);
+
+    // Dominator tree numbering, so Dominates() is a range check
+    std::vector<int> dom_enter;
+    std::vector<int> dom_exit;
+};
+
+// Builds and analyzes the graph of program and prints it to out; program
+// itself is left as it is
+void dump_cfg(CompiledProgram & program, FILE * out);
+
+#endif /* _CFG_H_ */
@@ -7,19 +7,28 @@
 #include <cstdlib>
 #include <cstdarg>
 #include <cctype>
+#include <cerrno>
+#include <climits>
 #include <cstring>
 #include <string>
+#include <thread>
+#include <unistd.h>
 #include "compiler.h"
+#include "bytecode.h"
+#include "batch.h"
+#include "cfg.h"
+#include "emit_c.h"
+#include "inputbuf.h"
+#include "ircache.h"
+#include "optimizer.h"
+#include "profile.h"
 
 using namespace std;
 
 #define DEBUG 1     // 1 => Turn ON debugging, 0 => Turn OFF debugging
 
-int mem[1000];
-int next_available = 0;
-
-std::vector<int> inputs;
-int next_input = 0;
+#define CACHE_LINE_SIZE 64
+#define ARENA_BLOCK_NODES 4096
 
 void debug(const char* format, ...)
 {
@@ -32,8 +41,285 @@ void debug(const char* format, ...)
     }
 }
 
-void execute_program(struct InstructionNode * program)
+IRArena::IRArena() : block_used(ARENA_BLOCK_NODES)
+{
+}
+
+IRArena::~IRArena()
+{
+    for (size_t i = 0; i < blocks.size(); i++)
+        free(blocks[i]);
+}
+
+struct InstructionNode * IRArena::NewInstruction(InstructionType type)
+{
+    if (block_used == ARENA_BLOCK_NODES)
+    {
+        InstructionNode * block = (InstructionNode *) malloc(ARENA_BLOCK_NODES * sizeof(InstructionNode));
+        if (block == NULL)
+        {
+            debug("Error: out of memory allocating instructions.\n");
+            exit(1);
+        }
+        blocks.push_back(block);
+        block_used = 0;
+    }
+
+    InstructionNode * node = &blocks.back()[block_used++];
+    memset(node, 0, sizeof(InstructionNode));
+    node->type = type;
+    node->next = NULL;
+    return node;
+}
+
+size_t IRArena::Count() const
+{
+    if (blocks.empty())
+        return 0;
+    return (blocks.size() - 1) * ARENA_BLOCK_NODES + block_used;
+}
+
+int CompiledProgram::ConstantSlot(int value)
+{
+    unordered_map<int, int>::iterator it = constant_slots.find(value);
+    if (it != constant_slots.end())
+        return it->second;
+
+    int slot = memory_image.size();
+    memory_image.push_back(value);
+    is_constant.push_back(true);
+    constant_slots[value] = slot;
+    return slot;
+}
+
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+#define INT_TEXT_MAX 12     // sign, ten digits and the space
+
+OutputSink::OutputSink(int fd)
+    : fd(fd), buffer(NULL), used(0), capacity(OUTPUT_BUFFER_SIZE)
+{
+    buffer = (char *) malloc(capacity);
+    if (buffer == NULL)
+    {
+        debug("Error: cannot allocate an output buffer.\n");
+        exit(1);
+    }
+}
+
+OutputSink::~OutputSink()
+{
+    Flush();
+    free(buffer);
+}
+
+void OutputSink::Flush()
+{
+    if (fd < 0)
+        return;
+    size_t written = 0;
+    while (written < used)
+    {
+        ssize_t n = write(fd, buffer + written, used - written);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        written += n;
+    }
+    used = 0;
+}
+
+// A file sink drains the buffer, a memory sink doubles it
+void OutputSink::MakeRoom()
+{
+    if (fd >= 0)
+    {
+        Flush();
+        return;
+    }
+    capacity *= 2;
+    buffer = (char *) realloc(buffer, capacity);
+    if (buffer == NULL)
+    {
+        debug("Error: cannot allocate an output buffer.\n");
+        exit(1);
+    }
+}
+
+static const char digit_pairs[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+// Formats backwards from the space, two digits per division
+void OutputSink::WriteInt(int value)
+{
+    if (capacity - used < INT_TEXT_MAX)
+        MakeRoom();
+
+    char text[INT_TEXT_MAX];
+    char * end = text + INT_TEXT_MAX;
+    char * p = end;
+    unsigned magnitude = value < 0 ? 0u - (unsigned) value : (unsigned) value;
+    *--p = ' ';
+    while (magnitude >= 100)
+    {
+        unsigned pair = magnitude % 100;
+        magnitude /= 100;
+        p -= 2;
+        memcpy(p, digit_pairs + 2 * pair, 2);
+    }
+    if (magnitude >= 10)
+    {
+        p -= 2;
+        memcpy(p, digit_pairs + 2 * magnitude, 2);
+    }
+    else
+    {
+        *--p = (char) ('0' + magnitude);
+    }
+    if (value < 0)
+        *--p = '-';
+    memcpy(buffer + used, p, end - p);
+    used += end - p;
+}
+
+enum InputStatus {
+    INPUT_OK,
+    INPUT_END,
+    INPUT_OUT_OF_RANGE
+};
+
+/*
+ * Reads the next number of an input list in source form the way the lexer
+ * would: white space, then either a lone 0 or digits not starting with 0.
+ * Returns INPUT_END where the list ends.
+ */
+static InputStatus scan_input(const char * & cursor, const char * end, int & value)
+{
+    while (cursor < end && isspace((unsigned char) *cursor))
+        cursor++;
+    if (cursor == end || (unsigned) (*cursor - '0') > 9)
+        return INPUT_END;
+
+    unsigned long long number = *cursor++ - '0';
+    if (number != 0)
+    {
+        unsigned digit;
+        while (cursor < end && (digit = (unsigned) (*cursor - '0')) <= 9)
+        {
+            number = number * 10 + digit;
+            cursor++;
+            if (number > INT_MAX)
+                return INPUT_OUT_OF_RANGE;
+        }
+    }
+    value = (int) number;
+    return INPUT_OK;
+}
+
+static const char * input_error(InputStatus status)
+{
+    if (status == INPUT_OUT_OF_RANGE)
+        return "input out of range";
+    return "the program reads more inputs than were provided";
+}
+
+void CompiledProgram::ReadAllInputs()
+{
+    if (input_text.data() == NULL)
+        return;
+    const char * cursor = input_text.data();
+    const char * end = cursor + input_text.size();
+    int value;
+    InputStatus status;
+    while ((status = scan_input(cursor, end, value)) == INPUT_OK)
+        inputs.push_back(value);
+    if (status == INPUT_OUT_OF_RANGE)
+    {
+        debug("Error: %s.\n", input_error(status));
+        exit(1);
+    }
+    input_text = std::string_view();
+}
+
+ExecutionContext::ExecutionContext(const CompiledProgram & program, OutputSink * output)
+    : mem(NULL), slot_count(program.memory_image.size()), output(output), error(NULL),
+      program(program), inputs(&program.inputs), next_input(0),
+      input_cursor(NULL), input_end(NULL)
+{
+    size_t bytes = slot_count * sizeof(int);
+    bytes = (bytes + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+    if (bytes == 0)
+        bytes = CACHE_LINE_SIZE;
+
+    mem = (int *) aligned_alloc(CACHE_LINE_SIZE, bytes);
+    if (mem == NULL)
+    {
+        debug("Error: cannot allocate a memory frame of %d slots.\n", slot_count);
+        exit(1);
+    }
+    if (program.input_text.data() != NULL)
+        Reset(program.input_text);
+    else
+        Reset(program.inputs);
+}
+
+ExecutionContext::~ExecutionContext()
+{
+    free(mem);
+}
+
+void ExecutionContext::ResetFrame()
+{
+    if (slot_count > 0)
+        memcpy(mem, program.memory_image.data(), slot_count * sizeof(int));
+}
+
+void ExecutionContext::Reset(const std::vector<int> & inputs)
+{
+    ResetFrame();
+    error = NULL;
+    this->inputs = &inputs;
+    next_input = 0;
+    input_cursor = input_end = NULL;
+}
+
+void ExecutionContext::Reset(std::string_view input_text)
+{
+    ResetFrame();
+    error = NULL;
+    input_cursor = input_text.data();
+    input_end = input_cursor + input_text.size();
+}
+
+int ExecutionContext::NextInput()
+{
+    if (input_cursor != NULL)
+        return NextTextInput();
+    if (next_input >= inputs->size())
+    {
+        error = input_error(INPUT_END);
+        return 0;
+    }
+    return (*inputs)[next_input++];
+}
+
+int ExecutionContext::NextTextInput()
+{
+    int value;
+    InputStatus status = scan_input(input_cursor, input_end, value);
+    if (status != INPUT_OK)
+    {
+        error = input_error(status);
+        return 0;
+    }
+    return value;
+}
+
+void execute_program(struct InstructionNode * program, ExecutionContext & context)
 {
+    int * mem = context.mem;
     struct InstructionNode * pc = program;
     int op1, op2, result;
 
@@ -46,13 +332,13 @@ void execute_program(struct InstructionNode * program)
                 break;
             case IN:
 
-                mem[pc->input_inst.var_index] = inputs[next_input];
-                next_input++;
+                mem[pc->input_inst.var_index] = context.NextInput();
+                if (context.error != NULL)
+                    return;
                 pc = pc->next;
                 break;
             case OUT:
-                printf("%d ", mem[pc->output_inst.var_index]);
-		fflush(stdin);
+                context.output->WriteInt(mem[pc->output_inst.var_index]);
                 pc = pc->next;
                 break;
             case ASSIGN:
@@ -114,6 +400,24 @@ void execute_program(struct InstructionNode * program)
                         else
                             pc = pc->cjmp_inst.target;
                         break;
+                    case CONDITION_EQUAL:
+                        if(op1 == op2)
+                            pc = pc->next;
+                        else
+                            pc = pc->cjmp_inst.target;
+                        break;
+                    case CONDITION_GREATER_EQUAL:
+                        if(op1 >= op2)
+                            pc = pc->next;
+                        else
+                            pc = pc->cjmp_inst.target;
+                        break;
+                    case CONDITION_LESS_EQUAL:
+                        if(op1 <= op2)
+                            pc = pc->next;
+                        else
+                            pc = pc->cjmp_inst.target;
+                        break;
                 }
                 break;
             case JMP:
@@ -133,10 +437,172 @@ void execute_program(struct InstructionNode * program)
     }
 }
 
-int main()
+// Runs program with execution counting instead of an engine, then writes
+// the report to stderr and the folded stacks to folded_path as requested
+static void run_profiled(CompiledProgram & program, ExecutionContext & context, OutputSink & sink,
+                         bool report, const char * folded_path)
+{
+    ExecutionProfile profile;
+    profile_program(program, context, profile);
+    sink.Flush();
+    if (report)
+        write_profile_report(profile, stderr);
+    if (folded_path != NULL)
+    {
+        FILE * folded = fopen(folded_path, "w");
+        if (folded == NULL)
+        {
+            debug("Error: cannot write %s: %s\n", folded_path, strerror(errno));
+            exit(1);
+        }
+        write_folded_stacks(profile, folded);
+        fclose(folded);
+    }
+}
+
+static void usage()
 {
-    struct InstructionNode * program;
-    program = parse_generate_intermediate_representation();
-    execute_program(program);
-    return 0;
+    fprintf(stderr,
+            "usage: a.out [--engine=reference|switch|threaded|register|jit] [-O0] [--opt-report] [--dump-cfg]\n"
+            "             [--emit-c] [--cache=DIR] [--pair-stats] [--profile] [--profile-folded=FILE]\n"
+            "             [--batch=FILE [--threads=N]] [program]\n"
+            "The program is read from stdin when no file is given.\n");
+    exit(1);
+}
+
+int main(int argc, char * argv[])
+{
+    struct CompiledProgram * program;
+    BytecodeProgram bytecode;
+    ExecutionEngine engine = ENGINE_THREADED;
+    const char * batch_path = NULL;
+    const char * source_path = NULL;
+    const char * cache_dir = NULL;
+    int threads = thread::hardware_concurrency();
+    bool optimize = true;
+    bool opt_report = false;
+    bool print_cfg = false;
+    bool emit_c = false;
+    bool pair_stats = false;
+    bool profile = false;
+    const char * folded_path = NULL;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--engine=reference") == 0)
+            engine = ENGINE_REFERENCE;
+        else if (strcmp(argv[i], "--engine=switch") == 0)
+            engine = ENGINE_SWITCH;
+        else if (strcmp(argv[i], "--engine=threaded") == 0)
+            engine = ENGINE_THREADED;
+        else if (strcmp(argv[i], "--engine=register") == 0)
+            engine = ENGINE_REGISTER;
+        else if (strcmp(argv[i], "--engine=jit") == 0)
+            engine = ENGINE_JIT;
+        else if (strncmp(argv[i], "--batch=", 8) == 0)
+            batch_path = argv[i] + 8;
+        else if (strncmp(argv[i], "--threads=", 10) == 0)
+            threads = atoi(argv[i] + 10);
+        else if (strcmp(argv[i], "-O0") == 0)
+            optimize = false;
+        else if (strcmp(argv[i], "--opt-report") == 0)
+            opt_report = true;
+        else if (strcmp(argv[i], "--dump-cfg") == 0)
+            print_cfg = true;
+        else if (strcmp(argv[i], "--emit-c") == 0)
+            emit_c = true;
+        else if (strncmp(argv[i], "--cache=", 8) == 0)
+            cache_dir = argv[i] + 8;
+        else if (strcmp(argv[i], "--pair-stats") == 0)
+            pair_stats = true;
+        else if (strcmp(argv[i], "--profile") == 0)
+            profile = true;
+        else if (strncmp(argv[i], "--profile-folded=", 17) == 0)
+            folded_path = argv[i] + 17;
+        else if (argv[i][0] != '-' && source_path == NULL)
+            source_path = argv[i];
+        else
+            usage();
+    }
+
+    // The source stays loaded for the whole run: it is the cache key, and
+    // executions read the input list from it as they go. A cached program
+    // runs on its bytecode; the instructions are only loaded for the
+    // engines and reports that work on them.
+    InputBuffer source;
+    source.Open(source_path);
+    bool registers = engine == ENGINE_REGISTER;
+    bool with_code = engine == ENGINE_REFERENCE || print_cfg || emit_c || profile ||
+        folded_path != NULL;
+    program = NULL;
+    if (cache_dir != NULL)
+        program = load_cached_program(cache_dir, source.Unread(), optimize, registers,
+                                      with_code, bytecode);
+    if (program == NULL)
+    {
+        program = parse_generate_intermediate_representation(source.Unread());
+        if (optimize)
+            optimize_program(*program, opt_report ? stderr : NULL);
+    }
+    if (print_cfg)
+        dump_cfg(*program, stderr);
+    if (emit_c)
+    {
+        emit_c_program(*program, stdout);
+        delete program;
+        return 0;
+    }
+    if (bytecode.code.empty())
+    {
+        if (registers)
+            compile_registers(*program, bytecode);
+        else
+            compile_bytecode(*program, bytecode);
+        if (cache_dir != NULL)
+            save_cached_program(cache_dir, source.Unread(), optimize, registers, *program, bytecode);
+    }
+
+    int status = 0;
+    if (batch_path != NULL)
+    {
+        vector< vector<int> > input_vectors;
+        vector<string> outputs;
+        vector<const char *> errors;
+
+        read_input_vectors(batch_path, input_vectors);
+        execute_batch(engine, *program, bytecode, input_vectors, threads, outputs, errors);
+        for (size_t i = 0; i < outputs.size(); i++)
+        {
+            // A run that stopped keeps its line, with the error after what
+            // it printed
+            fwrite(outputs[i].data(), 1, outputs[i].size(), stdout);
+            if (errors[i] != NULL)
+            {
+                debug("Error: line %zu: %s.", i + 1, errors[i]);
+                status = 1;
+            }
+            fputc('\n', stdout);
+        }
+    }
+    else
+    {
+        OutputSink sink(STDOUT_FILENO);
+        ExecutionContext context(*program, &sink);
+        if (profile || folded_path != NULL)
+            run_profiled(*program, context, sink, profile, folded_path);
+        else if (pair_stats)
+            profile_opcode_pairs(bytecode, context, stderr);
+        else
+            execute_with_engine(engine, *program, bytecode, context);
+        // Keep the message after everything the program printed
+        sink.Flush();
+        if (context.error != NULL)
+        {
+            debug("Error: %s.\n", context.error);
+            status = 1;
+        }
+    }
+
+    delete program;
+    return status;
 }
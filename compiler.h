@@ -6,15 +6,12 @@
 #ifndef _COMPILER_H_
 #define _COMPILER_H_
 
+#include <cstdio>
 #include <string>
+#include <string_view>
+#include <unordered_map>
 #include <vector>
 
-extern int mem[1000];
-extern int next_available;
-
-extern std::vector<int> inputs;
-extern int next_input;
-
 enum ArithmeticOperatorType {
     OPERATOR_NONE = 123,
     OPERATOR_PLUS,
@@ -26,7 +23,15 @@ enum ArithmeticOperatorType {
 enum ConditionalOperatorType {
     CONDITION_GREATER = 345,
     CONDITION_LESS,
-    CONDITION_NOTEQUAL
+    CONDITION_NOTEQUAL,
+
+    /*
+     * The source language has no syntax for these. The optimizer produces
+     * them when it needs the negation of one of the conditions above.
+     */
+    CONDITION_EQUAL,
+    CONDITION_GREATER_EQUAL,
+    CONDITION_LESS_EQUAL
 };
 
 enum InstructionType
@@ -42,6 +47,7 @@ enum InstructionType
 struct InstructionNode
 {
     InstructionType type;
+    int line_no;        // source line it came from, 0 if none; fills padding
 
     union
     {
@@ -84,12 +90,153 @@ struct InstructionNode
     struct InstructionNode * next; // next statement in the list or NULL
 };
 
+/*
+ * Bump-pointer allocator for the InstructionNodes of one program. Nodes are
+ * carved out of large blocks in allocation order and are only released all
+ * at once, when the arena is destroyed.
+ */
+class IRArena
+{
+  public:
+    IRArena();
+    ~IRArena();
+
+    // Returns a zeroed node of the given type with next == NULL
+    struct InstructionNode * NewInstruction(InstructionType type);
+
+    // Number of nodes allocated so far
+    size_t Count() const;
+
+  private:
+    IRArena(const IRArena &);
+    IRArena & operator=(const IRArena &);
+
+    std::vector<struct InstructionNode *> blocks;
+    size_t block_used;
+};
+
+/*
+ * Everything the parser produces for one program. memory_image holds the
+ * initial value of every slot the parser allocated: 0 for variables and the
+ * literal for constant pool entries. Constant slots are never written after
+ * parsing.
+ */
+struct CompiledProgram
+{
+    CompiledProgram() : head(NULL) {}
+
+    // Returns the constant pool slot holding value, adding one if needed.
+    // The optimizer uses this to materialize values it folds.
+    int ConstantSlot(int value);
+
+    // Moves the whole input list from input_text into inputs, for consumers
+    // that need all of it up front
+    void ReadAllInputs();
+
+    struct InstructionNode * head;
+    std::vector<int> memory_image;
+    std::vector<bool> is_constant;
+    std::unordered_map<int, int> constant_slots;    // value -> slot
+    std::vector<int> inputs;
+
+    // The input list still in source form, when the parser left it in a
+    // buffer that outlives the program; executions read it on demand. Its
+    // data() is NULL when inputs holds the list instead.
+    std::string_view input_text;
+    IRArena arena;      // owns every node reachable from head
+};
+
+/*
+ * Destination of OUT. Values are formatted straight into a buffer that is
+ * handed to write(2) when it fills up and on Flush(), so printing takes no
+ * locks and no allocations. A sink without a file descriptor keeps
+ * everything in memory until Clear().
+ */
+class OutputSink
+{
+  public:
+    // Writes to fd, or keeps the output in memory when fd is -1
+    explicit OutputSink(int fd);
+    ~OutputSink();      // flushes
+
+    // Appends value followed by a space, as "%d " would
+    void WriteInt(int value);
+
+    void Flush();
+
+    // Output held in memory: everything since Clear() for a memory sink,
+    // what is not yet flushed otherwise
+    const char * Data() const { return buffer; }
+    size_t Size() const { return used; }
+    void Clear() { used = 0; }
+
+  private:
+    OutputSink(const OutputSink &);
+    OutputSink & operator=(const OutputSink &);
+
+    void MakeRoom();
+
+    int fd;
+    char * buffer;
+    size_t used;
+    size_t capacity;
+};
+
+/*
+ * Runtime state of one execution: a cache-line aligned memory frame sized to
+ * the program's slot count, the input cursor and the output sink. Contexts
+ * share nothing, so any number of them can run side by side.
+ *
+ * An IN with no valid input left sets error, and every engine stops right
+ * after it; the caller reports the error once the output is flushed.
+ */
+class ExecutionContext
+{
+  public:
+    ExecutionContext(const CompiledProgram & program, OutputSink * output);
+    ~ExecutionContext();
+
+    // Restores the frame to the program's memory image and rewinds the
+    // input cursor to the start of inputs
+    void Reset(const std::vector<int> & inputs);
+    // Same, with an input list in source form that is parsed as it is read
+    void Reset(std::string_view input_text);
+
+    // The next input, or 0 with error set when there is none
+    int NextInput();
+
+    int * mem;
+    int slot_count;
+    OutputSink * output;
+    const char * error;             // NULL unless the run stopped on an input
+
+  private:
+    ExecutionContext(const ExecutionContext &);
+    ExecutionContext & operator=(const ExecutionContext &);
+
+    void ResetFrame();
+    int NextTextInput();
+
+    const CompiledProgram & program;
+    const std::vector<int> * inputs;
+    size_t next_input;
+    const char * input_cursor;      // NULL unless reading an input_text
+    const char * input_end;
+};
+
 void debug(const char* format, ...);
 
+void execute_program(struct InstructionNode * program, ExecutionContext & context);
+
 //---------------------------------------------------------
 // You should write the following function:
 
-struct InstructionNode * parse_generate_intermediate_representation();
+// Parses the program in path, or stdin when path is NULL
+struct CompiledProgram * parse_generate_intermediate_representation(const char * path);
+
+// Parses a program whose source text is already in memory and stays there
+// while the program runs: the input list is left in input_text
+struct CompiledProgram * parse_generate_intermediate_representation(std::string_view text);
 
 /*
   NOTE:
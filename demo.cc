@@ -10,71 +10,111 @@
 #include <string>
 #include <vector>
 #include <unordered_map>
+#include <pthread.h>
 
 using namespace std;
 
-LexicalAnalyzer lexer;
-unordered_map<string, int> var_location;
+/*
+ * A straight-line piece of IR under construction. tail is the node whose
+ * next pointer continues the fragment, so appending is O(1).
+ */
+struct Fragment {
+    InstructionNode* head;
+    InstructionNode* tail;
+};
+
+LexicalAnalyzer* lexer;
+CompiledProgram* compiled;
+vector<int> symbol_location;     // indexed by Token::symbol, -1 = no slot yet
 
 InstructionNode* parse_program();
 void parse_var_section();
 void parse_id_list();
-int get_var_location(string name);
+InstructionNode* new_instruction(InstructionType type, int line_no);
+int allocate_slot(int initial_value, bool constant);
+int get_var_location(const Token& token);
+int get_constant_location(int value);
 ArithmeticOperatorType parse_op();
 int parse_primary();
-InstructionNode* parse_assign_stmt();
+Fragment parse_assign_stmt();
 ConditionalOperatorType parse_relop();
-InstructionNode* parse_stmt();
-InstructionNode* parse_stmt_list();
-InstructionNode* parse_body();
-InstructionNode* parse_if_stmt();
-InstructionNode* parse_while_stmt();
-InstructionNode* parse_switch_stmt();
-InstructionNode* parse_for_stmt();
-InstructionNode* parse_input_stmt();
-InstructionNode* parse_output_stmt();
+Fragment parse_stmt();
+Fragment parse_stmt_list();
+Fragment parse_body();
+Fragment parse_if_stmt();
+Fragment parse_while_stmt();
+Fragment parse_switch_stmt();
+Fragment parse_for_stmt();
+Fragment parse_input_stmt();
+Fragment parse_output_stmt();
 void parse_inputs();
 
 InstructionNode* parse_program(){
     parse_var_section();
-    InstructionNode* body = parse_body();
+    Fragment body = parse_body();
     parse_inputs();
-    return body;
+    return body.head;
 }
 
 void parse_var_section(){
     parse_id_list();
-    Token token = lexer.GetToken();
+    Token token = lexer->GetToken();
     if (token.token_type != SEMICOLON){
         cout << "Error: Missing semicolon at line " << token.line_no << "\n";
         exit(1);
     }
 }
 
-int get_var_location(string name){
-    if (var_location.count(name) == 0){
-        var_location[name] = next_available;
-        next_available++;
+// All nodes of a program live in its arena and are freed with it. Each one
+// records the line of the statement it implements, for --profile.
+InstructionNode* new_instruction(InstructionType type, int line_no){
+    InstructionNode* node = compiled->arena.NewInstruction(type);
+    node->line_no = line_no;
+    return node;
+}
+
+// The memory image grows with every slot, so the frame built from it at
+// execution time has exactly as many slots as the program uses
+int allocate_slot(int initial_value, bool constant){
+    int address = compiled->memory_image.size();
+    compiled->memory_image.push_back(initial_value);
+    compiled->is_constant.push_back(constant);
+    return address;
+}
+
+int get_var_location(const Token& token){
+    if (token.symbol >= (int) symbol_location.size()){
+        symbol_location.resize(token.symbol + 1, -1);
+    }
+    int& location = symbol_location[token.symbol];
+    if (location < 0){
+        location = allocate_slot(0, false);
     }
-    return var_location[name];
+    return location;
+}
+
+// Literals are interned so every occurrence of the same value shares one slot
+int get_constant_location(int value){
+    return compiled->ConstantSlot(value);
 }
 
 void parse_id_list(){
-    Token token = lexer.GetToken();
-    if (token.token_type != ID) {
-        cout << "Error: Expected identifier at line " << token.line_no << "\n";
-        exit(1);
-    }
-    get_var_location(token.lexeme);
-    Token next = lexer.peek(1);
-    if (next.token_type == COMMA){
-        lexer.GetToken();
-        parse_id_list();
+    for (;;){
+        Token token = lexer->GetToken();
+        if (token.token_type != ID) {
+            cout << "Error: Expected identifier at line " << token.line_no << "\n";
+            exit(1);
+        }
+        get_var_location(token);
+        Token next = lexer->peek(1);
+        if (next.token_type != COMMA)
+            break;
+        lexer->GetToken();
     }
 }
 
 ArithmeticOperatorType parse_op(){
-    Token token = lexer.GetToken();
+    Token token = lexer->GetToken();
     switch (token.token_type){
         case PLUS:
             return OPERATOR_PLUS;
@@ -91,15 +131,12 @@ ArithmeticOperatorType parse_op(){
 }
 
 int parse_primary(){
-    Token token = lexer.GetToken();
+    Token token = lexer->GetToken();
     if (token.token_type == ID){
-        return get_var_location(token.lexeme);
+        return get_var_location(token);
     }
     else if (token.token_type == NUM){
-        int address = next_available;
-        mem[address] = stoi(token.lexeme);
-        next_available++;
-        return address;
+        return get_constant_location(stoi(string(token.lexeme)));
     }
     else {
         cout << "Error: Expected identifier or number at line " << token.line_no << "\n";
@@ -107,14 +144,15 @@ int parse_primary(){
     }
 }
 
-InstructionNode* parse_assign_stmt(){
-    Token token = lexer.GetToken();
+Fragment parse_assign_stmt(){
+    Token token = lexer->GetToken();
     if (token.token_type != ID){
         cout << "Error: Expected identifier at line " << token.line_no << "\n";
         exit(1);
     }
-    int leftHandSide = get_var_location(token.lexeme);
-    token = lexer.GetToken();
+    int line_no = token.line_no;
+    int leftHandSide = get_var_location(token);
+    token = lexer->GetToken();
     if (token.token_type != EQUAL) {
         cout << "Error: Expected '=' at line " << token.line_no << "\n";
         exit(1);
@@ -123,7 +161,7 @@ InstructionNode* parse_assign_stmt(){
     ArithmeticOperatorType op = OPERATOR_NONE;
     int op2 = -1;
 
-    token = lexer.peek(1);
+    token = lexer->peek(1);
     if (token.token_type == PLUS || token.token_type == MINUS ||
         token.token_type == MULT || token.token_type == DIV){
         
@@ -131,24 +169,23 @@ InstructionNode* parse_assign_stmt(){
         op2 = parse_primary();
     }
 
-    token = lexer.GetToken();
+    token = lexer->GetToken();
     if (token.token_type != SEMICOLON){
         cout << "Error: Missing semicolon at line " << token.line_no << "\n";
         exit(1);
     }
     
-    InstructionNode* node = new InstructionNode;
-    node->type = ASSIGN;
+    InstructionNode* node = new_instruction(ASSIGN, line_no);
     node->assign_inst.left_hand_side_index = leftHandSide;
     node->assign_inst.operand1_index = op1;
     node->assign_inst.operand2_index = op2;
     node->assign_inst.op = op;
     node->next = NULL;
-    return node;
+    return Fragment{node, node};
 }
 
 ConditionalOperatorType parse_relop(){
-    Token token = lexer.GetToken();
+    Token token = lexer->GetToken();
     switch (token.token_type){
         case LESS:
             return CONDITION_LESS;
@@ -162,8 +199,8 @@ ConditionalOperatorType parse_relop(){
     }
 }
 
-InstructionNode* parse_stmt(){
-    Token token = lexer.peek(1);
+Fragment parse_stmt(){
+    Token token = lexer->peek(1);
     if (token.token_type == ID)
         return parse_assign_stmt();
     else if (token.token_type == WHILE)
@@ -184,32 +221,33 @@ InstructionNode* parse_stmt(){
     }
 }
 
-InstructionNode* parse_stmt_list(){
-    InstructionNode* stmt = parse_stmt();
-    Token token = lexer.peek(1);
-    if (token.token_type == ID || token.token_type == WHILE ||
-        token.token_type == IF || token.token_type == SWITCH ||
-        token.token_type == FOR || token.token_type == OUTPUT ||
-        token.token_type == INPUT){
-
-        InstructionNode* rest = parse_stmt_list();
-        InstructionNode* current = stmt;
-        while(current->next != NULL){
-            current = current->next;
-        }
-        current->next = rest;
-    }
-    return stmt;
+// Statements are appended one after another rather than by recursing on the
+// rest of the list, so long bodies need neither stack depth nor a walk to
+// the end of the list
+Fragment parse_stmt_list(){
+    Fragment list = parse_stmt();
+    Token token = lexer->peek(1);
+    while (token.token_type == ID || token.token_type == WHILE ||
+           token.token_type == IF || token.token_type == SWITCH ||
+           token.token_type == FOR || token.token_type == OUTPUT ||
+           token.token_type == INPUT){
+
+        Fragment stmt = parse_stmt();
+        list.tail->next = stmt.head;
+        list.tail = stmt.tail;
+        token = lexer->peek(1);
+    }
+    return list;
 }
 
-InstructionNode* parse_body(){
-    Token token = lexer.GetToken();
+Fragment parse_body(){
+    Token token = lexer->GetToken();
     if (token.token_type != LBRACE){
         cout << "Error: Expected '{' at line " << token.line_no << "\n";
         exit(1);
     }
-    InstructionNode* stmt_list = parse_stmt_list();
-    token = lexer.GetToken();
+    Fragment stmt_list = parse_stmt_list();
+    token = lexer->GetToken();
     if (token.token_type != RBRACE){
         cout << "Error: Expected '}' at line " << token.line_no << "\n";
         exit(1);
@@ -217,133 +255,120 @@ InstructionNode* parse_body(){
     return stmt_list;
 }
 
-InstructionNode* parse_if_stmt(){
-    Token token = lexer.GetToken();
+Fragment parse_if_stmt(){
+    Token token = lexer->GetToken();
     if (token.token_type != IF){
         cout << "Error: Expected 'if' at line " << token.line_no << "\n";
         exit(1);
     }
+    int line_no = token.line_no;
     int op1 = parse_primary();
     ConditionalOperatorType relop = parse_relop();
     int op2 = parse_primary();
-    InstructionNode* jump = new InstructionNode;
-    jump->type = CJMP;
+    InstructionNode* jump = new_instruction(CJMP, line_no);
     jump->cjmp_inst.condition_op = relop;
     jump->cjmp_inst.operand1_index = op1;
     jump->cjmp_inst.operand2_index = op2;
 
-    InstructionNode* body = parse_body();
-    InstructionNode* noop = new InstructionNode;
-    noop->type = NOOP;
+    Fragment body = parse_body();
+    InstructionNode* noop = new_instruction(NOOP, line_no);
     noop->next = NULL;
 
-    InstructionNode* current = body;
-    while(current->next != NULL){
-        current = current->next;
-    }
-    current->next = noop;
+    body.tail->next = noop;
 
     jump->cjmp_inst.target = noop;
-    jump->next = body;
+    jump->next = body.head;
 
-    return jump;
+    return Fragment{jump, noop};
 }
 
-InstructionNode* parse_while_stmt(){
-    Token token = lexer.GetToken();
+Fragment parse_while_stmt(){
+    Token token = lexer->GetToken();
     if (token.token_type != WHILE){
         cout << "Error: Expected 'while' at line " << token.line_no << "\n";
         exit(1);
     }
+    int line_no = token.line_no;
     int op1 = parse_primary();
     ConditionalOperatorType relop = parse_relop();
     int op2 = parse_primary();
-    InstructionNode* cond = new InstructionNode;
-    cond->type = CJMP;
+    InstructionNode* cond = new_instruction(CJMP, line_no);
     cond->cjmp_inst.condition_op = relop;
     cond->cjmp_inst.operand1_index = op1;
     cond->cjmp_inst.operand2_index = op2;
 
-    InstructionNode* body = parse_body();
-    InstructionNode* jump = new InstructionNode;
-    jump->type = JMP;
+    Fragment body = parse_body();
+    InstructionNode* jump = new_instruction(JMP, line_no);
     jump->jmp_inst.target = cond;
 
-    InstructionNode* noop = new InstructionNode;
-    noop->type = NOOP;
+    InstructionNode* noop = new_instruction(NOOP, line_no);
     noop->next = NULL;
 
-    InstructionNode* current = body;
-    while(current->next != NULL){
-        current = current->next;
-    }
-    current->next = jump;
+    body.tail->next = jump;
     jump->next = noop;
 
-    cond->next = body;
+    cond->next = body.head;
     cond->cjmp_inst.target = noop;
 
-    return cond;
+    return Fragment{cond, noop};
 }
 
-InstructionNode* parse_switch_stmt(){
-    Token token = lexer.GetToken();
+Fragment parse_switch_stmt(){
+    Token token = lexer->GetToken();
     if (token.token_type != SWITCH){
         cout << "Error: Expected 'switch' at line " << token.line_no << "\n";
         exit(1);
     }
+    int line_no = token.line_no;
 
-    token = lexer.GetToken();
+    token = lexer->GetToken();
     if (token.token_type != ID){
         cout << "Error: Expected identifier at line " << token.line_no << "\n";
         exit(1);
     }
-    int switch_var_loc = get_var_location(token.lexeme);
+    int switch_var_loc = get_var_location(token);
 
-    token = lexer.GetToken();
+    token = lexer->GetToken();
     if (token.token_type != LBRACE){
         cout << "Error: Expected '{' at line " << token.line_no << "\n";
         exit(1);
     }
 
     vector<InstructionNode*> case_cjmps;
-    vector<InstructionNode*> case_bodies;
-    InstructionNode* defaultBody = NULL;
-    token = lexer.peek(1);
+    vector<Fragment> case_bodies;
+    Fragment defaultBody = {NULL, NULL};
+    token = lexer->peek(1);
     while (token.token_type == CASE){
-        lexer.GetToken();
-        token = lexer.GetToken();
+        int case_line = lexer->GetToken().line_no;
+        token = lexer->GetToken();
         if (token.token_type != NUM){
             cout << "Error: Expected number at line " << token.line_no << "\n";
             exit(1);
         }
-        int case_value_loc = next_available;
-        mem[case_value_loc] = stoi(token.lexeme);
-        next_available++;
+        int case_value_loc = get_constant_location(stoi(string(token.lexeme)));
 
-        token = lexer.GetToken();
+        token = lexer->GetToken();
         if (token.token_type != COLON){
             cout << "Error: Expected ':' at line " << token.line_no << "\n";
             exit(1);
         }
 
-        InstructionNode* body = parse_body();
-        InstructionNode* cjmp = new InstructionNode;
-        cjmp->type = CJMP;
+        Fragment body = parse_body();
+        InstructionNode* cjmp = new_instruction(CJMP, case_line);
         cjmp->cjmp_inst.condition_op = CONDITION_NOTEQUAL;
         cjmp->cjmp_inst.operand1_index = switch_var_loc;
         cjmp->cjmp_inst.operand2_index = case_value_loc;
-        cjmp->cjmp_inst.target = body;
+        cjmp->cjmp_inst.target = body.head;
         cjmp->next = NULL;
         case_cjmps.push_back(cjmp);
         case_bodies.push_back(body);
-        token = lexer.peek(1);
+        token = lexer->peek(1);
     }
 
-    token = lexer.peek(1);
+    token = lexer->peek(1);
     if (token.token_type == DEFAULT){
-        lexer.GetToken();
-        token = lexer.GetToken();
+        lexer->GetToken();
+        token = lexer->GetToken();
         if (token.token_type != COLON){
             cout << "Error: Expected ':' at line " << token.line_no << "\n";
             exit(1);
@@ -351,34 +376,25 @@ InstructionNode* parse_switch_stmt(){
         defaultBody = parse_body();
     }
 
-    token = lexer.GetToken();
+    token = lexer->GetToken();
     if (token.token_type != RBRACE){
         cout << "Error: Expected '}' at line " << token.line_no << "\n";
         exit(1);
     }
 
-    InstructionNode* noop = new InstructionNode;
-    noop->type = NOOP;
+    InstructionNode* noop = new_instruction(NOOP, line_no);
     noop->next = NULL;
 
-    for (InstructionNode* body : case_bodies){
-        InstructionNode* tail = body;
-        while(tail->next != NULL){
-            tail = tail->next;
-        }
-        InstructionNode* jump = new InstructionNode;
-        jump->type = JMP;
+    for (size_t i = 0; i < case_bodies.size(); i++){
+        Fragment& body = case_bodies[i];
+        InstructionNode* jump = new_instruction(JMP, case_cjmps[i]->line_no);
         jump->jmp_inst.target = noop;
         jump->next = NULL;
-        tail->next = jump;
+        body.tail->next = jump;
     }
 
-    if (defaultBody != NULL){
-        InstructionNode* tail = defaultBody;
-        while(tail->next != NULL){
-            tail = tail->next;
-        }
-        tail->next = noop;
+    if (defaultBody.head != NULL){
+        defaultBody.tail->next = noop;
     }
 
     int n = case_cjmps.size();
@@ -387,8 +403,8 @@ InstructionNode* parse_switch_stmt(){
             case_cjmps[i]->next = case_cjmps[i+1];
         }
         else {
-            if (defaultBody != NULL){
-                case_cjmps[i]->next = defaultBody;
+            if (defaultBody.head != NULL){
+                case_cjmps[i]->next = defaultBody.head;
             }
             else {
                 case_cjmps[i]->next = noop;
@@ -397,143 +413,166 @@ InstructionNode* parse_switch_stmt(){
     }
 
     if (n>0)
-        return case_cjmps[0];
-    else if (defaultBody != NULL)
-        return defaultBody;
+        return Fragment{case_cjmps[0], noop};
+    else if (defaultBody.head != NULL)
+        return Fragment{defaultBody.head, noop};
     else
-        return noop;
+        return Fragment{noop, noop};
 }
 
-InstructionNode* parse_for_stmt(){
-    lexer.GetToken();
+Fragment parse_for_stmt(){
+    int line_no = lexer->GetToken().line_no;
 
-    if (lexer.GetToken().token_type != LPAREN){
+    if (lexer->GetToken().token_type != LPAREN){
         cout << "Error: Expected '('\n";
         exit(1);
     }
 
-    InstructionNode* assign_stmt1 = parse_assign_stmt();
+    Fragment assign_stmt1 = parse_assign_stmt();
 
     int op1 = parse_primary();
     ConditionalOperatorType relop = parse_relop();
     int op2 = parse_primary();
 
-    if (lexer.GetToken().token_type != SEMICOLON) {
+    if (lexer->GetToken().token_type != SEMICOLON) {
         cout << "Error: Expected ';' after condition\n";
         exit(1);
     }
 
-    InstructionNode* cond = new InstructionNode;
-    cond->type = CJMP;
+    InstructionNode* cond = new_instruction(CJMP, line_no);
     cond->cjmp_inst.operand1_index = op1;
     cond->cjmp_inst.operand2_index = op2;
     cond->cjmp_inst.condition_op = relop;
 
-    InstructionNode* assign_stmt2 = parse_assign_stmt();
+    Fragment assign_stmt2 = parse_assign_stmt();
 
-    if (lexer.GetToken().token_type != RPAREN){
+    if (lexer->GetToken().token_type != RPAREN){
         cout << "Error: Expected ')'\n";
         exit(1);
     }
 
-    InstructionNode* body = parse_body();
-    InstructionNode* noop = new InstructionNode;
-    noop->type = NOOP;
+    Fragment body = parse_body();
+    InstructionNode* noop = new_instruction(NOOP, line_no);
     noop->next = NULL;
 
-    InstructionNode* last = assign_stmt1;
-    while (last->next){
-        last = last->next;
-    }
-    last->next = cond;
-    cond->next = body;
+    assign_stmt1.tail->next = cond;
+    cond->next = body.head;
     cond->cjmp_inst.target = noop;
 
-    InstructionNode* lastBody = body;
-    while(lastBody->next){
-        lastBody = lastBody->next;
-    }
-    lastBody->next = assign_stmt2;
-
-    InstructionNode* lastAssignStmt2 = assign_stmt2;
-    while(lastAssignStmt2->next){
-        lastAssignStmt2 = lastAssignStmt2->next;
-    }
+    body.tail->next = assign_stmt2.head;
 
-    InstructionNode* jumpBack = new InstructionNode;
-    jumpBack->type = JMP;
+    InstructionNode* jumpBack = new_instruction(JMP, line_no);
     jumpBack->jmp_inst.target = cond;
     jumpBack->next = noop;
-    lastAssignStmt2->next = jumpBack;
-    return assign_stmt1;
+    assign_stmt2.tail->next = jumpBack;
+    return Fragment{assign_stmt1.head, noop};
 }
 
-InstructionNode* parse_input_stmt(){
-    Token token = lexer.GetToken();
+Fragment parse_input_stmt(){
+    Token token = lexer->GetToken();
     if (token.token_type != INPUT){
         cout << "Error: Expected 'input' at line " << token.line_no << "\n";
         exit(1);
     }
-    token = lexer.GetToken();
+    int line_no = token.line_no;
+    token = lexer->GetToken();
     if (token.token_type != ID){
         cout << "Error: Expected identifier at line " << token.line_no << "\n";
         exit(1);
     }
-    int loc = get_var_location(token.lexeme);
-    token = lexer.GetToken();
+    int loc = get_var_location(token);
+    token = lexer->GetToken();
     if (token.token_type != SEMICOLON){
         cout << "Error: Missing semicolon at line " << token.line_no << "\n";
         exit(1);
     }
-    InstructionNode* node = new InstructionNode;
-    node->type = IN;
+    InstructionNode* node = new_instruction(IN, line_no);
     node->input_inst.var_index = loc;
     node->next = NULL;
-    return node;
+    return Fragment{node, node};
 }
 
-InstructionNode* parse_output_stmt(){
-    Token token = lexer.GetToken();
+Fragment parse_output_stmt(){
+    Token token = lexer->GetToken();
     if (token.token_type != OUTPUT){
         cout << "Error: Expected 'output' at line " << token.line_no << "\n";
         exit(1);
     }
-    token = lexer.GetToken();
+    int line_no = token.line_no;
+    token = lexer->GetToken();
     if (token.token_type != ID){
         cout << "Error: Expected identifier at line " << token.line_no << "\n";
         exit(1);
     }
-    int loc = get_var_location(token.lexeme);
-    token = lexer.GetToken();
+    int loc = get_var_location(token);
+    token = lexer->GetToken();
     if (token.token_type != SEMICOLON){
         cout << "Error: Missing semicolon at line " << token.line_no << "\n";
         exit(1);
     }
-    InstructionNode* node = new InstructionNode;
-    node->type = OUT;
+    InstructionNode* node = new_instruction(OUT, line_no);
     node->output_inst.var_index = loc;
     node->next = NULL;
-    return node;
+    return Fragment{node, node};
 }
 
+// The input list may be empty, e.g. for programs run with --batch that get
+// their inputs from elsewhere. It is not tokenized: only its start is
+// checked here and executions parse the numbers as they read them.
 void parse_inputs() {
-    Token token = lexer.GetToken();
-    if (token.token_type != NUM) {
+    string_view rest = lexer->Rest();
+    size_t start = 0;
+    while (start < rest.size() && isspace((unsigned char) rest[start])) {
+        start++;
+    }
+    if (start < rest.size() && !isdigit((unsigned char) rest[start])) {
         cout << "Error: Expected NUM in input list\n";
         exit(1);
     }
-    inputs.push_back(stoi(token.lexeme));
+    compiled->input_text = rest;
+}
 
-    Token next = lexer.peek(1);
-    while (next.token_type == NUM) {
-        token = lexer.GetToken();
-        inputs.push_back(stoi(token.lexeme));
-        next = lexer.peek(1);
+// Nesting depth is bounded only by the stack, so the parser runs on its own
+// thread with a large stack. Untouched stack pages are never committed.
+#define PARSER_STACK_SIZE ((size_t) 1 << 30)
+
+void* parse_program_thread(void*){
+    compiled->head = parse_program();
+    return NULL;
+}
+
+static CompiledProgram* parse_with(LexicalAnalyzer& analyzer){
+    lexer = &analyzer;
+    symbol_location.clear();
+    compiled = new CompiledProgram;
+
+    pthread_attr_t attr;
+    pthread_t thread;
+    pthread_attr_init(&attr);
+    if (pthread_attr_setstacksize(&attr, PARSER_STACK_SIZE) == 0 &&
+        pthread_create(&thread, &attr, parse_program_thread, NULL) == 0){
+        pthread_join(thread, NULL);
     }
+    else {
+        parse_program_thread(NULL);
+    }
+    pthread_attr_destroy(&attr);
+
+    lexer = NULL;
+    return compiled;
+}
+
+// The source goes away with the analyzer, so the inputs are read right away
+CompiledProgram* parse_generate_intermediate_representation(const char* path){
+    LexicalAnalyzer analyzer(path);
+    CompiledProgram* program = parse_with(analyzer);
+    program->ReadAllInputs();
+    return program;
 }
 
-InstructionNode* parse_generate_intermediate_representation(){
-    return parse_program();
+CompiledProgram* parse_generate_intermediate_representation(string_view text){
+    LexicalAnalyzer analyzer(text);
+    return parse_with(analyzer);
 }
 
 // struct InstructionNode *parse_generate_intermediate_representation()
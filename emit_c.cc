@@ -0,0 +1,200 @@
+#include <climits>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "cfg.h"
+#include "emit_c.h"
+
+using namespace std;
+
+static const char * const c_includes =
+    "#include <limits.h>\n"
+    "#include <signal.h>\n"
+    "#include <stdio.h>\n"
+    "#include <stdlib.h>\n"
+    "#include <string.h>\n"
+    "\n";
+
+// Runtime support copied into every generated program. Messages and output
+// format follow ExecutionContext and execute_program().
+static const char * const c_runtime =
+    "static char output_buffer[65536];\n"
+    "static size_t output_length;\n"
+    "static size_t next_input;\n"
+    "static int read_stdin;\n"
+    "\n"
+    "static inline void flush_output(void)\n"
+    "{\n"
+    "    fwrite(output_buffer, 1, output_length, stdout);\n"
+    "    output_length = 0;\n"
+    "}\n"
+    "\n"
+    "static inline int read_input(void)\n"
+    "{\n"
+    "    int value;\n"
+    "    if (read_stdin && scanf(\"%d\", &value) == 1)\n"
+    "        return value;\n"
+    "    if (!read_stdin && next_input < input_count)\n"
+    "        return input_table[next_input++];\n"
+    "    flush_output();\n"
+    "    fputs(\"Error: the program reads more inputs than were provided.\\n\", stdout);\n"
+    "    exit(1);\n"
+    "}\n"
+    "\n"
+    "static inline void print_int(int value)\n"
+    "{\n"
+    "    char digits[10];\n"
+    "    int count = 0;\n"
+    "    unsigned magnitude = value < 0 ? 0u - (unsigned) value : (unsigned) value;\n"
+    "    if (output_length > sizeof(output_buffer) - 12)\n"
+    "        flush_output();\n"
+    "    if (value < 0)\n"
+    "        output_buffer[output_length++] = '-';\n"
+    "    do {\n"
+    "        digits[count++] = (char) ('0' + magnitude % 10);\n"
+    "        magnitude /= 10;\n"
+    "    } while (magnitude != 0);\n"
+    "    while (count > 0)\n"
+    "        output_buffer[output_length++] = digits[--count];\n"
+    "    output_buffer[output_length++] = ' ';\n"
+    "}\n"
+    "\n"
+    "/* Traps where the interpreters' division does */\n"
+    "static inline int divide(int a, int b)\n"
+    "{\n"
+    "    if (b == 0 || (a == INT_MIN && b == -1))\n"
+    "        raise(SIGFPE);\n"
+    "    return a / b;\n"
+    "}\n"
+    "\n";
+
+static string c_literal(int value)
+{
+    if (value == INT_MIN)
+        return "(-2147483647 - 1)";
+    return to_string(value);
+}
+
+// Constants are written as literals, variables as v<slot>
+static string c_operand(const CompiledProgram & program, int slot)
+{
+    if (program.is_constant[slot])
+        return c_literal(program.memory_image[slot]);
+    return "v" + to_string(slot);
+}
+
+// The comparison under which a CJMP jumps, i.e. its condition negated
+static const char * c_failed_condition(ConditionalOperatorType condition)
+{
+    switch (condition)
+    {
+        case CONDITION_GREATER:       return "<=";
+        case CONDITION_LESS:          return ">=";
+        case CONDITION_EQUAL:         return "!=";
+        case CONDITION_GREATER_EQUAL: return "<";
+        case CONDITION_LESS_EQUAL:    return ">";
+        default:                      return "==";
+    }
+}
+
+static void emit_assignment(const CompiledProgram & program, InstructionNode * node, FILE * out)
+{
+    string lhs = c_operand(program, node->assign_inst.left_hand_side_index);
+    string left = c_operand(program, node->assign_inst.operand1_index);
+    if (node->assign_inst.op == OPERATOR_NONE)
+    {
+        fprintf(out, "    %s = %s;\n", lhs.c_str(), left.c_str());
+        return;
+    }
+    string right = c_operand(program, node->assign_inst.operand2_index);
+    if (node->assign_inst.op == OPERATOR_DIV)
+    {
+        fprintf(out, "    %s = divide(%s, %s);\n", lhs.c_str(), left.c_str(), right.c_str());
+        return;
+    }
+
+    // Unsigned arithmetic wraps around like the interpreters do in practice,
+    // without giving the C compiler undefined behavior to exploit
+    const char * op = "+";
+    if (node->assign_inst.op == OPERATOR_MINUS)
+        op = "-";
+    else if (node->assign_inst.op == OPERATOR_MULT)
+        op = "*";
+    fprintf(out, "    %s = (int) ((unsigned) %s %s (unsigned) %s);\n",
+            lhs.c_str(), left.c_str(), op, right.c_str());
+}
+
+void emit_c_program(CompiledProgram & program, FILE * out)
+{
+    LinearCode linear;
+    linearize_program(program, linear);
+    const vector<InstructionNode*> & code = linear.code;
+    program.ReadAllInputs();
+
+    fprintf(out, "/* Generated by a.out --emit-c. Build it with cc -O2. */\n");
+    fputs(c_includes, out);
+    fprintf(out, "static const int input_table[] = {");
+    for (size_t i = 0; i < program.inputs.size(); i++)
+        fprintf(out, "%s%s%s", i % 16 == 0 ? "\n    " : " ", c_literal(program.inputs[i]).c_str(),
+                i + 1 < program.inputs.size() ? "," : "");
+    if (program.inputs.empty())
+        fprintf(out, " 0");
+    fprintf(out, "\n};\n");
+    fprintf(out, "static const size_t input_count = %zu;\n\n", program.inputs.size());
+    fputs(c_runtime, out);
+
+    fprintf(out, "int main(int argc, char ** argv)\n{\n");
+    for (size_t slot = 0; slot < program.memory_image.size(); slot++)
+    {
+        if (!program.is_constant[slot])
+            fprintf(out, "    int v%zu = %s;\n", slot, c_literal(program.memory_image[slot]).c_str());
+    }
+    fprintf(out, "\n    read_stdin = argc > 1 && strcmp(argv[1], \"--stdin\") == 0;\n\n");
+
+    vector<bool> labeled(code.size() + 1, false);
+    for (size_t i = 0; i < code.size(); i++)
+    {
+        if (linear.target[i] >= 0)
+            labeled[linear.target[i]] = true;
+    }
+
+    for (size_t i = 0; i < code.size(); i++)
+    {
+        InstructionNode * node = code[i];
+        if (labeled[i])
+            fprintf(out, "L%zu:\n", i);
+        switch (node->type)
+        {
+            case NOOP:
+                break;
+            case IN:
+                fprintf(out, "    %s = read_input();\n",
+                        c_operand(program, node->input_inst.var_index).c_str());
+                break;
+            case OUT:
+                fprintf(out, "    print_int(%s);\n",
+                        c_operand(program, node->output_inst.var_index).c_str());
+                break;
+            case ASSIGN:
+                emit_assignment(program, node, out);
+                break;
+            case CJMP:
+                fprintf(out, "    if (%s %s %s)\n        goto L%d;\n",
+                        c_operand(program, node->cjmp_inst.operand1_index).c_str(),
+                        c_failed_condition(node->cjmp_inst.condition_op),
+                        c_operand(program, node->cjmp_inst.operand2_index).c_str(),
+                        linear.target[i]);
+                break;
+            case JMP:
+                fprintf(out, "    goto L%d;\n", linear.target[i]);
+                break;
+            default:
+                debug("Error: invalid value for pc->type (%d).\n", node->type);
+                exit(1);
+                break;
+        }
+    }
+
+    fprintf(out, "    flush_output();\n    return 0;\n}\n");
+}
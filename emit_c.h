@@ -0,0 +1,17 @@
+#ifndef _EMIT_C_H_
+#define _EMIT_C_H_
+
+#include <cstdio>
+
+#include "compiler.h"
+
+/*
+ * Writes program to out as a standalone C program that behaves like
+ * executing it: variables become locals of main(), jumps become gotos, IN
+ * reads a table holding the inputs that followed the program (or stdin when
+ * the program is run with --stdin) and OUT goes through a buffer written
+ * with one fwrite per 64 KB.
+ */
+void emit_c_program(CompiledProgram & program, FILE * out);
+
+#endif /* _EMIT_C_H_ */
@@ -3,44 +3,95 @@
  *
  * Do not share this file with anyone
  */
-#include <iostream>
-#include <istream>
-#include <vector>
-#include <string>
 #include <cstdio>
+#include <cstdlib>
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "inputbuf.h"
 
 using namespace std;
 
-bool InputBuffer::EndOfInput()
+InputBuffer::InputBuffer()
+    : data(""), length(0), cursor(0), past_end(false),
+      heap_data(NULL), mapping(NULL), mapping_length(0)
 {
-    if (!input_buffer.empty())
-        return false;
-    else
-        return cin.eof();
 }
 
-char InputBuffer::UngetChar(char c)
+InputBuffer::~InputBuffer()
 {
-    if (c != EOF)
-        input_buffer.push_back(c);;
-    return c;
+    if (mapping != NULL)
+        munmap(mapping, mapping_length);
+    free(heap_data);
 }
 
-void InputBuffer::GetChar(char& c)
+void InputBuffer::Open(const char * path)
 {
-    if (!input_buffer.empty()) {
-        c = input_buffer.back();
-        input_buffer.pop_back();
-    } else {
-        cin.get(c);
+    int fd = 0;
+    if (path != NULL) {
+        fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            fprintf(stderr, "Error: cannot open %s\n", path);
+            exit(1);
+        }
     }
+
+    struct stat info;
+    if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+        off_t offset = lseek(fd, 0, SEEK_CUR);
+        void * region = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (region != MAP_FAILED) {
+            madvise(region, info.st_size, MADV_SEQUENTIAL);
+            mapping = region;
+            mapping_length = info.st_size;
+            data = (const char *) region;
+            length = info.st_size;
+            cursor = (offset > 0 && offset <= info.st_size) ? offset : 0;
+        }
+    }
+    if (mapping == NULL)
+        ReadAll(fd);
+
+    if (path != NULL)
+        close(fd);
 }
 
-string InputBuffer::UngetString(string s)
+void InputBuffer::OpenText(string_view text)
 {
-    for (int i = 0; i < s.size(); i++)
-        input_buffer.push_back(s[s.size()-i-1]);
-    return s;
+    data = text.data();
+    length = text.size();
+    cursor = 0;
+}
+
+void InputBuffer::ReadAll(int fd)
+{
+    size_t capacity = 1 << 16;
+    size_t size = 0;
+    char * buffer = (char *) malloc(capacity);
+
+    for (;;) {
+        if (buffer == NULL) {
+            fprintf(stderr, "Error: out of memory reading the program\n");
+            exit(1);
+        }
+        if (size == capacity) {
+            capacity *= 2;
+            buffer = (char *) realloc(buffer, capacity);
+            continue;
+        }
+        ssize_t n = read(fd, buffer + size, capacity - size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        size += n;
+    }
+
+    heap_data = buffer;
+    data = buffer;
+    length = size;
+    cursor = 0;
 }
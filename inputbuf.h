@@ -6,18 +6,72 @@
 #ifndef __INPUT_BUFFER__H__
 #define __INPUT_BUFFER__H__
 
+#include <cstddef>
 #include <string>
-#include <vector>
+#include <string_view>
 
+/*
+ * The whole source is held in one contiguous buffer: a memory-mapped file
+ * when the source is a regular file, otherwise a single bulk read of stdin.
+ * Characters are read through a cursor, so ungetting a character only moves
+ * the cursor back and lexemes can point straight into the buffer.
+ */
 class InputBuffer {
   public:
-    void GetChar(char&);
-    char UngetChar(char);
-    std::string UngetString(std::string);
-    bool EndOfInput();
+    InputBuffer();
+    ~InputBuffer();
+
+    // Loads path, or stdin when path is NULL. Exits if it cannot be read.
+    void Open(const char * path);
+
+    // Reads text, which the caller keeps alive, instead of loading a source
+    void OpenText(std::string_view text);
+
+    void GetChar(char& c)
+    {
+        if (cursor < length) {
+            c = data[cursor++];
+        } else {
+            c = '\0';
+            past_end = true;
+        }
+    }
+
+    // Only the characters that were just read can be pushed back
+    char UngetChar(char c)
+    {
+        if (!past_end && cursor > 0)
+            cursor--;
+        return c;
+    }
+
+    std::string UngetString(std::string s)
+    {
+        cursor -= (s.size() < cursor) ? s.size() : cursor;
+        return s;
+    }
+
+    bool EndOfInput() { return past_end; }
+
+    size_t Position() { return cursor; }
+    std::string_view Text(size_t start, size_t end) { return std::string_view(data + start, end - start); }
+    std::string_view From(size_t start) { return std::string_view(data + start, length - start); }
+    std::string_view Unread() { return From(cursor); }
 
   private:
-    std::vector<char> input_buffer;
+    InputBuffer(const InputBuffer &);
+    InputBuffer & operator=(const InputBuffer &);
+
+    void ReadAll(int fd);
+
+    const char * data;
+    size_t length;
+    size_t cursor;
+    bool past_end;
+
+    char * heap_data;       // owned copy when the source could not be mapped
+    void * mapping;         // owned mapping otherwise
+    size_t mapping_length;
 };
 
 #endif  //__INPUT_BUFFER__H__
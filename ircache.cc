@@ -0,0 +1,472 @@
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#include "cfg.h"
+#include "ircache.h"
+
+using namespace std;
+
+static uint64_t rotate_left(uint64_t value, int bits)
+{
+    return (value << bits) | (value >> (64 - bits));
+}
+
+size_t program_section_length(string_view text)
+{
+    size_t i = text.find('{');
+    int depth = 0;
+    for (; i < text.size(); i++)
+    {
+        if (text[i] == '{')
+            depth++;
+        else if (text[i] == '}' && --depth == 0)
+            return i + 1;
+    }
+    return text.size();
+}
+
+// Eight bytes at a time with the murmur3 mixing steps
+uint64_t hash_source(string_view text, bool optimized, bool registers)
+{
+    const uint64_t c1 = 0x87c37b91114253d5ULL;
+    const uint64_t c2 = 0x4cf5ad432745937fULL;
+    uint64_t hash = optimized ? 0x9e3779b97f4a7c15ULL : 0;
+    if (registers)
+        hash ^= 0xc2b2ae3d27d4eb4fULL;
+    size_t i = 0;
+    for (; i + 8 <= text.size(); i += 8)
+    {
+        uint64_t k;
+        memcpy(&k, text.data() + i, 8);
+        k = rotate_left(k * c1, 31) * c2;
+        hash = rotate_left(hash ^ k, 27) * 5 + 0x52dce729;
+    }
+    uint64_t tail = 0;
+    for (size_t j = text.size(); j > i; j--)
+        tail = (tail << 8) | (unsigned char) text[j - 1];
+    hash ^= rotate_left(tail * c1, 31) * c2;
+
+    hash ^= text.size();
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+static size_t padded(size_t size)
+{
+    return (size + 3) & ~(size_t) 3;
+}
+
+static size_t image_size(const ImageHeader & header)
+{
+    return sizeof(ImageHeader)
+        + (size_t) header.instruction_count * sizeof(ImageInstruction)
+        + (size_t) header.slot_count * sizeof(int32_t)
+        + padded(header.slot_count)
+        + (size_t) header.bytecode_count * sizeof(BytecodeInstruction)
+        + (size_t) header.frame_count * sizeof(int32_t)
+        + (size_t) header.switch_count * sizeof(ImageSwitch)
+        + (size_t) header.key_count * sizeof(int32_t)
+        + (size_t) header.target_count * sizeof(uint32_t);
+}
+
+// Writes count elements of size bytes unless an earlier write failed
+static bool write_array(const void * data, size_t size, size_t count, FILE * out, bool ok)
+{
+    return ok && (count == 0 || fwrite(data, size, count, out) == count);
+}
+
+bool write_program_image(CompiledProgram & program, const BytecodeProgram & bytecode,
+                         uint64_t key, uint64_t source_length, const char * path)
+{
+    LinearCode linear;
+    linearize_program(program, linear);
+
+    ImageHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = IMAGE_MAGIC;
+    header.version = IMAGE_VERSION;
+    header.key = key;
+    header.source_length = source_length;
+    header.instruction_count = linear.code.size();
+    header.slot_count = program.memory_image.size();
+    header.bytecode_count = bytecode.code.size();
+    header.frame_count = bytecode.frame_image.size();
+    header.switch_count = bytecode.switches.size();
+
+    vector<ImageInstruction> code(linear.code.size());
+    for (size_t i = 0; i < linear.code.size(); i++)
+    {
+        InstructionNode * node = linear.code[i];
+        ImageInstruction & record = code[i];
+        memset(&record, 0, sizeof(record));
+        record.type = node->type;
+        record.line = node->line_no;
+        record.target = linear.target[i];
+        switch (node->type)
+        {
+            case IN:
+                record.a = node->input_inst.var_index;
+                break;
+            case OUT:
+                record.a = node->output_inst.var_index;
+                break;
+            case ASSIGN:
+                record.a = node->assign_inst.left_hand_side_index;
+                record.b = node->assign_inst.operand1_index;
+                record.c = node->assign_inst.operand2_index;
+                record.op = node->assign_inst.op;
+                break;
+            case CJMP:
+                record.b = node->cjmp_inst.operand1_index;
+                record.c = node->cjmp_inst.operand2_index;
+                record.op = node->cjmp_inst.condition_op;
+                break;
+            default:
+                break;
+        }
+    }
+    vector<uint8_t> is_constant(padded(header.slot_count), 0);
+    for (size_t slot = 0; slot < program.is_constant.size(); slot++)
+        is_constant[slot] = program.is_constant[slot];
+
+    vector<ImageSwitch> switches(bytecode.switches.size());
+    vector<int32_t> keys;
+    vector<uint32_t> targets;
+    for (size_t s = 0; s < switches.size(); s++)
+    {
+        const SwitchTable & table = bytecode.switches[s];
+        switches[s].low = table.low;
+        switches[s].key_count = table.keys.size();
+        switches[s].target_count = table.targets.size();
+        keys.insert(keys.end(), table.keys.begin(), table.keys.end());
+        targets.insert(targets.end(), table.targets.begin(), table.targets.end());
+    }
+    header.key_count = keys.size();
+    header.target_count = targets.size();
+
+    FILE * out = fopen(path, "wb");
+    if (out == NULL)
+        return false;
+    bool ok = write_array(&header, sizeof(header), 1, out, true);
+    ok = write_array(code.data(), sizeof(ImageInstruction), code.size(), out, ok);
+    ok = write_array(program.memory_image.data(), sizeof(int32_t), header.slot_count, out, ok);
+    ok = write_array(is_constant.data(), 1, is_constant.size(), out, ok);
+    ok = write_array(bytecode.code.data(), sizeof(BytecodeInstruction), bytecode.code.size(), out, ok);
+    ok = write_array(bytecode.frame_image.data(), sizeof(int32_t), header.frame_count, out, ok);
+    ok = write_array(switches.data(), sizeof(ImageSwitch), switches.size(), out, ok);
+    ok = write_array(keys.data(), sizeof(int32_t), keys.size(), out, ok);
+    ok = write_array(targets.data(), sizeof(uint32_t), targets.size(), out, ok);
+    if (fclose(out) != 0)
+        ok = false;
+    return ok;
+}
+
+// Checks everything a record refers to, so a damaged image is rejected
+// instead of producing a program that indexes out of its frame
+static bool valid_instruction(const ImageInstruction & record, const ImageHeader & header)
+{
+    uint32_t slots = header.slot_count;
+    switch (record.type)
+    {
+        case NOOP:
+            return true;
+        case IN:
+        case OUT:
+            return (uint32_t) record.a < slots;
+        case ASSIGN:
+            if ((uint32_t) record.a >= slots || (uint32_t) record.b >= slots)
+                return false;
+            if (record.op < OPERATOR_NONE || record.op > OPERATOR_DIV)
+                return false;
+            return record.op == OPERATOR_NONE || (uint32_t) record.c < slots;
+        case CJMP:
+            if ((uint32_t) record.b >= slots || (uint32_t) record.c >= slots)
+                return false;
+            if (record.op < CONDITION_GREATER || record.op > CONDITION_LESS_EQUAL)
+                return false;
+            return (uint32_t) record.target < header.instruction_count;
+        case JMP:
+            return (uint32_t) record.target < header.instruction_count;
+        default:
+            return false;
+    }
+}
+
+// Checks every operand, jump target and switch of the bytecode the way
+// valid_instruction() checks the IR. Fused opcodes must be the ones
+// fuse_superinstructions() picks, since they read the record after them.
+static bool valid_bytecode(BytecodeProgram & bytecode, uint32_t slot_count)
+{
+    vector<BytecodeInstruction> & code = bytecode.code;
+    uint32_t size = code.size();
+    uint32_t frame = bytecode.frame_image.empty() ? slot_count : bytecode.frame_image.size();
+    if (size == 0)
+        return false;
+    BytecodeOpcode last = unfused_opcode(code[size - 1].opcode);
+    if (last != BC_JMP && last != BC_HALT)
+        return false;
+
+    vector<uint8_t> fused(size);
+    for (uint32_t pc = 0; pc < size; pc++)
+    {
+        const BytecodeInstruction & inst = code[pc];
+        if (inst.opcode >= BC_OPCODE_COUNT)
+            return false;
+        fused[pc] = inst.opcode;
+        BytecodeOpcode opcode = unfused_opcode(inst.opcode);
+        code[pc].opcode = opcode;
+        bool ok;
+        switch (opcode)
+        {
+            case BC_NOOP:
+            case BC_HALT:
+                ok = true;
+                break;
+            case BC_IN:
+            case BC_OUT:
+            case BC_ASSIGN_MOV_IMM:
+                ok = inst.a < frame;
+                break;
+            case BC_ASSIGN_MOV:
+            case BC_ASSIGN_ADD_IMM:
+            case BC_ASSIGN_SUB_IMM:
+            case BC_ASSIGN_MULT_IMM:
+            case BC_ASSIGN_DIV_IMM:
+                ok = inst.a < frame && inst.b < frame;
+                break;
+            case BC_ASSIGN_ADD:
+            case BC_ASSIGN_SUB:
+            case BC_ASSIGN_MULT:
+            case BC_ASSIGN_DIV:
+                ok = inst.a < frame && inst.b < frame && inst.c < frame;
+                break;
+            case BC_CJMP_GREATER:
+            case BC_CJMP_LESS:
+            case BC_CJMP_NOTEQUAL:
+            case BC_CJMP_EQUAL:
+            case BC_CJMP_GREATER_EQUAL:
+            case BC_CJMP_LESS_EQUAL:
+                ok = inst.a < size && inst.b < frame && inst.c < frame;
+                break;
+            case BC_CJMP_GREATER_IMM:
+            case BC_CJMP_LESS_IMM:
+            case BC_CJMP_NOTEQUAL_IMM:
+            case BC_CJMP_EQUAL_IMM:
+            case BC_CJMP_GREATER_EQUAL_IMM:
+            case BC_CJMP_LESS_EQUAL_IMM:
+                ok = inst.a < size && inst.b < frame;
+                break;
+            case BC_JMP:
+                ok = inst.a < size;
+                break;
+            case BC_SWITCH_TABLE:
+                ok = inst.a < bytecode.switches.size() && inst.b < frame && inst.c < size;
+                break;
+            case BC_SWITCH_SEARCH:
+                ok = inst.a < bytecode.switches.size() && inst.b < frame && inst.c < size &&
+                    !bytecode.switches[inst.a].keys.empty() &&
+                    bytecode.switches[inst.a].keys.size() == bytecode.switches[inst.a].targets.size();
+                break;
+            default:
+                ok = false;
+                break;
+        }
+        if (!ok)
+            return false;
+    }
+    for (size_t s = 0; s < bytecode.switches.size(); s++)
+    {
+        const vector<uint32_t> & targets = bytecode.switches[s].targets;
+        for (size_t k = 0; k < targets.size(); k++)
+            if (targets[k] >= size)
+                return false;
+    }
+
+    fuse_superinstructions(bytecode);
+    for (uint32_t pc = 0; pc < size; pc++)
+        if (code[pc].opcode != fused[pc])
+            return false;
+    return true;
+}
+
+CompiledProgram * read_program_image(const char * path, uint64_t key, uint64_t source_length,
+                                     bool with_code, BytecodeProgram & bytecode)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (size_t) info.st_size < sizeof(ImageHeader))
+    {
+        close(fd);
+        return NULL;
+    }
+    size_t length = info.st_size;
+    void * mapping = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+        return NULL;
+
+    const char * base = (const char *) mapping;
+    ImageHeader header;
+    memcpy(&header, base, sizeof(header));
+    if (header.magic != IMAGE_MAGIC || header.version != IMAGE_VERSION || header.key != key ||
+        header.source_length != source_length || image_size(header) != length)
+    {
+        munmap(mapping, length);
+        return NULL;
+    }
+
+    const ImageInstruction * code = (const ImageInstruction *) (base + sizeof(ImageHeader));
+    const int32_t * memory_image = (const int32_t *) (code + header.instruction_count);
+    const uint8_t * is_constant = (const uint8_t *) (memory_image + header.slot_count);
+    const BytecodeInstruction * bytecode_code =
+        (const BytecodeInstruction *) (is_constant + padded(header.slot_count));
+    const int32_t * frame_image = (const int32_t *) (bytecode_code + header.bytecode_count);
+    const ImageSwitch * switches = (const ImageSwitch *) (frame_image + header.frame_count);
+    const int32_t * keys = (const int32_t *) (switches + header.switch_count);
+    const uint32_t * targets = (const uint32_t *) (keys + header.key_count);
+
+    bool valid = true;
+    for (uint32_t i = 0; with_code && valid && i < header.instruction_count; i++)
+        valid = valid_instruction(code[i], header);
+
+    bytecode.code.assign(bytecode_code, bytecode_code + header.bytecode_count);
+    bytecode.frame_image.assign(frame_image, frame_image + header.frame_count);
+    bytecode.switches.resize(header.switch_count);
+    uint32_t key_end = 0;
+    uint32_t target_end = 0;
+    for (uint32_t s = 0; valid && s < header.switch_count; s++)
+    {
+        const ImageSwitch & record = switches[s];
+        SwitchTable & table = bytecode.switches[s];
+        valid = record.key_count <= header.key_count - key_end &&
+            record.target_count <= header.target_count - target_end;
+        if (!valid)
+            break;
+        table.low = record.low;
+        table.keys.assign(keys + key_end, keys + key_end + record.key_count);
+        table.targets.assign(targets + target_end, targets + target_end + record.target_count);
+        key_end += record.key_count;
+        target_end += record.target_count;
+    }
+    valid = valid && key_end == header.key_count && target_end == header.target_count &&
+        valid_bytecode(bytecode, header.slot_count);
+    if (!valid)
+    {
+        bytecode = BytecodeProgram();
+        munmap(mapping, length);
+        return NULL;
+    }
+
+    CompiledProgram * program = new CompiledProgram;
+    program->memory_image.assign(memory_image, memory_image + header.slot_count);
+    program->is_constant.resize(header.slot_count);
+    for (uint32_t slot = 0; slot < header.slot_count; slot++)
+    {
+        program->is_constant[slot] = is_constant[slot] != 0;
+        if (is_constant[slot] && program->constant_slots.count(memory_image[slot]) == 0)
+            program->constant_slots[memory_image[slot]] = slot;
+    }
+
+    vector<InstructionNode*> nodes(with_code ? header.instruction_count : 0);
+    for (uint32_t i = 0; i < nodes.size(); i++)
+        nodes[i] = program->arena.NewInstruction((InstructionType) code[i].type);
+    for (uint32_t i = 0; i < nodes.size(); i++)
+    {
+        const ImageInstruction & record = code[i];
+        InstructionNode * node = nodes[i];
+        node->next = i + 1 < nodes.size() ? nodes[i + 1] : NULL;
+        node->line_no = record.line;
+        switch (node->type)
+        {
+            case IN:
+                node->input_inst.var_index = record.a;
+                break;
+            case OUT:
+                node->output_inst.var_index = record.a;
+                break;
+            case ASSIGN:
+                node->assign_inst.left_hand_side_index = record.a;
+                node->assign_inst.operand1_index = record.b;
+                node->assign_inst.operand2_index = record.c;
+                node->assign_inst.op = (ArithmeticOperatorType) record.op;
+                break;
+            case CJMP:
+                node->cjmp_inst.operand1_index = record.b;
+                node->cjmp_inst.operand2_index = record.c;
+                node->cjmp_inst.condition_op = (ConditionalOperatorType) record.op;
+                node->cjmp_inst.target = nodes[record.target];
+                break;
+            case JMP:
+                node->jmp_inst.target = nodes[record.target];
+                break;
+            default:
+                break;
+        }
+    }
+    program->head = nodes.empty() ? NULL : nodes[0];
+
+    munmap(mapping, length);
+    return program;
+}
+
+static string cache_path(const char * dir, uint64_t key)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx.ir", (unsigned long long) key);
+    return string(dir) + name;
+}
+
+// An input list that does not start with a number is a miss, so that the
+// parser reports it
+static bool valid_input_list(string_view inputs)
+{
+    size_t start = 0;
+    while (start < inputs.size() && isspace((unsigned char) inputs[start]))
+        start++;
+    return start == inputs.size() || isdigit((unsigned char) inputs[start]);
+}
+
+CompiledProgram * load_cached_program(const char * dir, string_view text, bool optimized,
+                                      bool registers, bool with_code, BytecodeProgram & bytecode)
+{
+    size_t length = program_section_length(text);
+    if (!valid_input_list(text.substr(length)))
+        return NULL;
+    uint64_t key = hash_source(text.substr(0, length), optimized, registers);
+    CompiledProgram * program = read_program_image(cache_path(dir, key).c_str(), key, length,
+                                                   with_code, bytecode);
+    if (program != NULL)
+        program->input_text = text.substr(length);
+    return program;
+}
+
+void save_cached_program(const char * dir, string_view text, bool optimized,
+                         bool registers, CompiledProgram & program,
+                         const BytecodeProgram & bytecode)
+{
+    // Only cache programs whose input list starts where a later load will
+    // look for it
+    size_t length = program_section_length(text);
+    if (program.input_text.data() != text.data() + length)
+        return;
+    uint64_t key = hash_source(text.substr(0, length), optimized, registers);
+    string path = cache_path(dir, key);
+    string temporary = path + "." + to_string(getpid());
+    if (write_program_image(program, bytecode, key, length, temporary.c_str()))
+        rename(temporary.c_str(), path.c_str());
+    else
+        unlink(temporary.c_str());
+}
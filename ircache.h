@@ -0,0 +1,103 @@
+#ifndef _IRCACHE_H_
+#define _IRCACHE_H_
+
+#include <cstdint>
+#include <string_view>
+
+#include "bytecode.h"
+#include "compiler.h"
+
+/*
+ * Binary image of a CompiledProgram and the BytecodeProgram compiled from
+ * it, in host byte order:
+ *
+ *   ImageHeader
+ *   ImageInstruction[instruction_count]   linear code, jump targets as indices
+ *   int32_t memory_image[slot_count]
+ *   uint8_t is_constant[slot_count]       padded to a multiple of 4
+ *   BytecodeInstruction[bytecode_count]
+ *   int32_t frame_image[frame_count]
+ *   ImageSwitch[switch_count]
+ *   int32_t keys[key_count]               of every switch in turn
+ *   uint32_t targets[target_count]        of every switch in turn
+ *
+ * Instruction i continues at i + 1 and the last one halts. The input list is
+ * not part of the image; each run reads it from its own source. The version
+ * goes up whenever the layout or the meaning of a field changes.
+ */
+#define IMAGE_MAGIC 0x31524921u     // "!IR1"
+#define IMAGE_VERSION 5
+
+struct ImageHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t key;                   // hash_source() of the program section
+    uint64_t source_length;         // length of the program section
+    uint32_t instruction_count;
+    uint32_t slot_count;
+    uint32_t bytecode_count;
+    uint32_t frame_count;
+    uint32_t switch_count;
+    uint32_t key_count;
+    uint32_t target_count;
+    uint32_t reserved;
+};
+
+// ASSIGN: a = left hand side, b and c operands, op the operator. CJMP: b and
+// c operands, op the condition. IN/OUT: a the variable.
+struct ImageInstruction {
+    int32_t type;
+    int32_t line;                   // InstructionNode::line_no
+    int32_t a;
+    int32_t b;
+    int32_t c;
+    int32_t op;
+    int32_t target;                 // -1 unless CJMP or JMP
+};
+
+struct ImageSwitch {
+    int32_t low;
+    uint32_t key_count;
+    uint32_t target_count;
+};
+
+// Length of the program section of a source, i.e. everything up to the
+// input list: the variable section and the body through its closing brace.
+// The whole text if the braces do not balance.
+size_t program_section_length(std::string_view text);
+
+// Key of a program section. Optimized and unoptimized programs differ, and
+// so do images of compile_registers() and compile_bytecode() code.
+uint64_t hash_source(std::string_view text, bool optimized, bool registers);
+
+// Writes program and its bytecode to path. Returns false if the file could
+// not be written.
+bool write_program_image(CompiledProgram & program, const BytecodeProgram & bytecode,
+                         uint64_t key, uint64_t source_length, const char * path);
+
+/*
+ * Maps the image at path and loads the bytecode from it as it is, so that a
+ * run needs no front end and no code generation. The InstructionNode list
+ * is only rebuilt with_code, for the consumers of the IR itself; otherwise
+ * the program has no code and just its memory image. Either way it has no
+ * input list. Returns NULL if there is no such file or it is not a valid
+ * image of this version for key.
+ */
+CompiledProgram * read_program_image(const char * path, uint64_t key, uint64_t source_length,
+                                     bool with_code, BytecodeProgram & bytecode);
+
+/*
+ * Cache of program images in directory dir, one file per program section,
+ * so runs of one program on different inputs share an image. text is the
+ * whole source; a loaded program reads its inputs lazily from the part of
+ * text after the program section. Loading returns NULL on a miss; saving is
+ * best effort and goes through a temporary file, so concurrent runs never
+ * see a partial image.
+ */
+CompiledProgram * load_cached_program(const char * dir, std::string_view text, bool optimized,
+                                      bool registers, bool with_code, BytecodeProgram & bytecode);
+void save_cached_program(const char * dir, std::string_view text, bool optimized,
+                         bool registers, CompiledProgram & program,
+                         const BytecodeProgram & bytecode);
+
+#endif /* _IRCACHE_H_ */
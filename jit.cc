@@ -0,0 +1,441 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "bytecode.h"
+
+using namespace std;
+
+#if defined(__x86_64__) && !defined(_WIN32)
+
+#include <sys/mman.h>
+
+// Called from generated code. The input is in the low half of the result;
+// bit 32 is set instead when there is none and the run has to stop.
+static uint64_t jit_input(ExecutionContext * context)
+{
+    int value = context->NextInput();
+    if (context->error != NULL)
+        return (uint64_t) 1 << 32;
+    return (uint32_t) value;
+}
+
+static void jit_output(ExecutionContext * context, int value)
+{
+    context->output->WriteInt(value);
+}
+
+// x86-64 registers by encoding
+enum {
+    RAX = 0,
+    RCX = 1,
+    RSI = 6
+};
+
+// Condition codes of the Jcc taken when a CJMP's condition fails, and the
+// unsigned one a jump table's bounds check uses
+enum {
+    CC_AE = 0x3,
+    CC_E = 0x4,
+    CC_NE = 0x5,
+    CC_L = 0xC,
+    CC_GE = 0xD,
+    CC_LE = 0xE,
+    CC_G = 0xF
+};
+
+/*
+ * Machine code for one program. rbx holds the frame and r12 the context for
+ * the whole run; eax and ecx are scratch. Every slot is accessed as
+ * [rbx + 4 * index], so values never stay in registers across instructions.
+ */
+class NativeCode {
+  public:
+    void Emit(uint8_t byte) { code.push_back(byte); }
+
+    void Emit32(uint32_t value)
+    {
+        for (int i = 0; i < 4; i++)
+            code.push_back((uint8_t) (value >> (8 * i)));
+    }
+
+    void Emit64(uint64_t value)
+    {
+        Emit32((uint32_t) value);
+        Emit32((uint32_t) (value >> 32));
+    }
+
+    // opcode with a ModRM operand of [rbx + 4 * slot] and reg in the reg field
+    void EmitSlot(uint8_t opcode, int reg, uint32_t slot)
+    {
+        Emit(opcode);
+        EmitSlotOperand(reg, slot);
+    }
+
+    void EmitSlotOperand(int reg, uint32_t slot)
+    {
+        uint32_t disp = 4 * slot;
+        if (disp < 128)
+        {
+            Emit(0x43 | (reg << 3));        // mod 01, rm rbx
+            Emit((uint8_t) disp);
+        }
+        else
+        {
+            Emit(0x83 | (reg << 3));        // mod 10, rm rbx
+            Emit32(disp);
+        }
+    }
+
+    void EmitCall(const void * function)
+    {
+        Emit(0x4C); Emit(0x89); Emit(0xE7);             // mov rdi, r12
+        Emit(0x48); Emit(0xB8);                         // mov rax, imm64
+        Emit64((uint64_t) (uintptr_t) function);
+        Emit(0xFF); Emit(0xD0);                         // call rax
+    }
+
+    // A rel32 jump to bytecode instruction target, patched by Link()
+    void EmitJump(int condition, uint32_t target)
+    {
+        if (condition < 0)
+        {
+            Emit(0xE9);
+        }
+        else
+        {
+            Emit(0x0F);
+            Emit(0x80 | condition);
+        }
+        fixups.push_back(make_pair(code.size(), target));
+        Emit32(0);
+    }
+
+    // A rel32 jump within the code being emitted, patched by PatchHere()
+    size_t EmitForwardJump(int condition)
+    {
+        Emit(0x0F);
+        Emit(0x80 | condition);
+        Emit32(0);
+        return code.size() - 4;
+    }
+
+    void PatchHere(size_t at)
+    {
+        int32_t rel = (int32_t) (code.size() - (at + 4));
+        memcpy(&code[at], &rel, 4);
+    }
+
+    // A jump table entry: the offset of bytecode instruction target from
+    // the start of the table at base, patched by Link()
+    void EmitTableEntry(size_t base, uint32_t target)
+    {
+        entries.push_back(make_pair(code.size(), make_pair(base, target)));
+        Emit32(0);
+    }
+
+    // Resolves jumps once start holds the offset of every instruction
+    void Link(const vector<uint32_t> & start)
+    {
+        for (size_t i = 0; i < fixups.size(); i++)
+        {
+            size_t at = fixups[i].first;
+            int32_t rel = (int32_t) start[fixups[i].second] - (int32_t) (at + 4);
+            memcpy(&code[at], &rel, 4);
+        }
+        for (size_t i = 0; i < entries.size(); i++)
+        {
+            size_t at = entries[i].first;
+            int32_t rel = (int32_t) start[entries[i].second.second] - (int32_t) entries[i].second.first;
+            memcpy(&code[at], &rel, 4);
+        }
+    }
+
+    vector<uint8_t> code;
+
+  private:
+    vector< pair<size_t, uint32_t> > fixups;    // rel32 offset, instruction
+    vector< pair<size_t, pair<size_t, uint32_t> > > entries;   // offset, (table, instruction)
+};
+
+static void emit_epilogue(NativeCode & native)
+{
+    native.Emit(0x48); native.Emit(0x83); native.Emit(0xC4); native.Emit(0x08);   // add rsp, 8
+    native.Emit(0x41); native.Emit(0x5C);                                       // pop r12
+    native.Emit(0x5B);                                                          // pop rbx
+    native.Emit(0xC3);                                                          // ret
+}
+
+// The Jcc that leaves a CJMP, i.e. the negation of its condition
+static int failed_condition(uint8_t opcode)
+{
+    switch (opcode)
+    {
+        case BC_CJMP_GREATER:       case BC_CJMP_GREATER_IMM:       return CC_LE;
+        case BC_CJMP_LESS:          case BC_CJMP_LESS_IMM:          return CC_GE;
+        case BC_CJMP_NOTEQUAL:      case BC_CJMP_NOTEQUAL_IMM:      return CC_E;
+        case BC_CJMP_EQUAL:         case BC_CJMP_EQUAL_IMM:         return CC_NE;
+        case BC_CJMP_GREATER_EQUAL: case BC_CJMP_GREATER_EQUAL_IMM: return CC_L;
+        default:                                                    return CC_G;
+    }
+}
+
+// Dense switch on eax: bounds check, then an indirect jump through a table
+// of offsets relative to the table, which follows the jump
+static void emit_switch_table(NativeCode & native, const SwitchTable & table, uint32_t otherwise)
+{
+    native.Emit(0x2D);                                          // sub eax, low
+    native.Emit32((uint32_t) table.low);
+    native.Emit(0x3D);                                          // cmp eax, size
+    native.Emit32(table.targets.size());
+    native.EmitJump(CC_AE, otherwise);
+    native.Emit(0x48); native.Emit(0x8D); native.Emit(0x0D);    // lea rcx, [rip + 9]
+    native.Emit32(9);
+    native.Emit(0x48); native.Emit(0x63);                       // movsxd rax, [rcx + 4 * rax]
+    native.Emit(0x04); native.Emit(0x81);
+    native.Emit(0x48); native.Emit(0x01); native.Emit(0xC8);    // add rax, rcx
+    native.Emit(0xFF); native.Emit(0xE0);                       // jmp rax
+    size_t base = native.code.size();
+    for (size_t i = 0; i < table.targets.size(); i++)
+        native.EmitTableEntry(base, table.targets[i]);
+}
+
+// Sparse switch on eax: a balanced tree of comparisons over keys[low, high)
+static void emit_switch_search(NativeCode & native, const SwitchTable & table,
+                               size_t low, size_t high, uint32_t otherwise)
+{
+    if (high - low <= SWITCH_MIN_CASES)
+    {
+        for (size_t i = low; i < high; i++)
+        {
+            native.Emit(0x3D);                                  // cmp eax, key
+            native.Emit32((uint32_t) table.keys[i]);
+            native.EmitJump(CC_E, table.targets[i]);
+        }
+        native.EmitJump(-1, otherwise);
+        return;
+    }
+    size_t middle = low + (high - low) / 2;
+    native.Emit(0x3D);
+    native.Emit32((uint32_t) table.keys[middle]);
+    native.EmitJump(CC_E, table.targets[middle]);
+    size_t above = native.EmitForwardJump(CC_G);
+    emit_switch_search(native, table, low, middle, otherwise);
+    native.PatchHere(above);
+    emit_switch_search(native, table, middle + 1, high, otherwise);
+}
+
+// Translates bytecode to native. Returns false if it cannot be encoded.
+static bool translate(const BytecodeProgram & bytecode, size_t frame_size, NativeCode & native)
+{
+    // Every displacement must fit in a signed 32-bit offset
+    if (frame_size > 0x1FFFFFFF)
+        return false;
+
+    native.Emit(0x53);                                      // push rbx
+    native.Emit(0x41); native.Emit(0x54);                   // push r12
+    native.Emit(0x48); native.Emit(0x83);                   // sub rsp, 8
+    native.Emit(0xEC); native.Emit(0x08);
+    native.Emit(0x48); native.Emit(0x89); native.Emit(0xFB);    // mov rbx, rdi
+    native.Emit(0x49); native.Emit(0x89); native.Emit(0xF4);    // mov r12, rsi
+
+    vector<uint32_t> start(bytecode.code.size());
+    for (size_t pc = 0; pc < bytecode.code.size(); pc++)
+    {
+        const BytecodeInstruction & inst = bytecode.code[pc];
+        start[pc] = native.code.size();
+        // Native code has no dispatch to save: a superinstruction is just
+        // its first instruction, and the rest is translated where it is
+        uint8_t opcode = unfused_opcode(inst.opcode);
+        switch (opcode)
+        {
+            case BC_NOOP:
+                break;
+            case BC_IN:
+            {
+                native.EmitCall((const void *) jit_input);
+                native.Emit(0x48); native.Emit(0x0F);           // bt rax, 32
+                native.Emit(0xBA); native.Emit(0xE0); native.Emit(32);
+                size_t has_input = native.EmitForwardJump(CC_AE);
+                emit_epilogue(native);
+                native.PatchHere(has_input);
+                native.EmitSlot(0x89, RAX, inst.a);             // mov [a], eax
+                break;
+            }
+            case BC_OUT:
+                native.EmitSlot(0x8B, RSI, inst.a);             // mov esi, [a]
+                native.EmitCall((const void *) jit_output);
+                break;
+            case BC_ASSIGN_MOV:
+                native.EmitSlot(0x8B, RAX, inst.b);             // mov eax, [b]
+                native.EmitSlot(0x89, RAX, inst.a);
+                break;
+            case BC_ASSIGN_ADD:
+                native.EmitSlot(0x8B, RAX, inst.b);
+                native.EmitSlot(0x03, RAX, inst.c);             // add eax, [c]
+                native.EmitSlot(0x89, RAX, inst.a);
+                break;
+            case BC_ASSIGN_SUB:
+                native.EmitSlot(0x8B, RAX, inst.b);
+                native.EmitSlot(0x2B, RAX, inst.c);             // sub eax, [c]
+                native.EmitSlot(0x89, RAX, inst.a);
+                break;
+            case BC_ASSIGN_MULT:
+                native.EmitSlot(0x8B, RAX, inst.b);
+                native.Emit(0x0F);
+                native.EmitSlot(0xAF, RAX, inst.c);             // imul eax, [c]
+                native.EmitSlot(0x89, RAX, inst.a);
+                break;
+            case BC_ASSIGN_DIV:
+                native.EmitSlot(0x8B, RAX, inst.b);
+                native.Emit(0x99);                              // cdq
+                native.EmitSlot(0xF7, 7, inst.c);               // idiv dword [c]
+                native.EmitSlot(0x89, RAX, inst.a);
+                break;
+            case BC_CJMP_GREATER:
+            case BC_CJMP_LESS:
+            case BC_CJMP_NOTEQUAL:
+            case BC_CJMP_EQUAL:
+            case BC_CJMP_GREATER_EQUAL:
+            case BC_CJMP_LESS_EQUAL:
+                native.EmitSlot(0x8B, RAX, inst.b);
+                native.EmitSlot(0x3B, RAX, inst.c);             // cmp eax, [c]
+                native.EmitJump(failed_condition(opcode), inst.a);
+                break;
+            case BC_JMP:
+                native.EmitJump(-1, inst.a);
+                break;
+            case BC_HALT:
+                emit_epilogue(native);
+                break;
+            case BC_ASSIGN_MOV_IMM:
+                native.EmitSlot(0xC7, 0, inst.a);               // mov dword [a], imm32
+                native.Emit32(inst.b);
+                break;
+            case BC_ASSIGN_ADD_IMM:
+                native.EmitSlot(0x8B, RAX, inst.b);
+                native.Emit(0x05);                              // add eax, imm32
+                native.Emit32(inst.c);
+                native.EmitSlot(0x89, RAX, inst.a);
+                break;
+            case BC_ASSIGN_SUB_IMM:
+                native.EmitSlot(0x8B, RAX, inst.b);
+                native.Emit(0x2D);                              // sub eax, imm32
+                native.Emit32(inst.c);
+                native.EmitSlot(0x89, RAX, inst.a);
+                break;
+            case BC_ASSIGN_MULT_IMM:
+                native.EmitSlot(0x8B, RAX, inst.b);
+                native.Emit(0x69); native.Emit(0xC0);           // imul eax, eax, imm32
+                native.Emit32(inst.c);
+                native.EmitSlot(0x89, RAX, inst.a);
+                break;
+            case BC_ASSIGN_DIV_IMM:
+                native.EmitSlot(0x8B, RAX, inst.b);
+                native.Emit(0xB8 + RCX);                        // mov ecx, imm32
+                native.Emit32(inst.c);
+                native.Emit(0x99);                              // cdq
+                native.Emit(0xF7); native.Emit(0xF9);           // idiv ecx
+                native.EmitSlot(0x89, RAX, inst.a);
+                break;
+            case BC_CJMP_GREATER_IMM:
+            case BC_CJMP_LESS_IMM:
+            case BC_CJMP_NOTEQUAL_IMM:
+            case BC_CJMP_EQUAL_IMM:
+            case BC_CJMP_GREATER_EQUAL_IMM:
+            case BC_CJMP_LESS_EQUAL_IMM:
+                native.EmitSlot(0x8B, RAX, inst.b);
+                native.Emit(0x3D);                              // cmp eax, imm32
+                native.Emit32(inst.c);
+                native.EmitJump(failed_condition(opcode), inst.a);
+                break;
+            case BC_SWITCH_TABLE:
+                native.EmitSlot(0x8B, RAX, inst.b);
+                emit_switch_table(native, bytecode.switches[inst.a], inst.c);
+                break;
+            case BC_SWITCH_SEARCH:
+                native.EmitSlot(0x8B, RAX, inst.b);
+                emit_switch_search(native, bytecode.switches[inst.a], 0,
+                                   bytecode.switches[inst.a].keys.size(), inst.c);
+                break;
+            default:
+                debug("Error: invalid bytecode opcode (%d).\n", inst.opcode);
+                exit(1);
+                break;
+        }
+    }
+
+    // compile_bytecode() ends every chain, but halt if control runs off
+    emit_epilogue(native);
+    native.Link(start);
+    return true;
+}
+
+typedef void (*NativeEntry)(int * mem, ExecutionContext * context);
+
+// Translates bytecode into engine_code.native, left NULL on failure. The
+// frame is only passed in at run time, so the code suits every execution.
+static void load_native(const BytecodeProgram & bytecode, size_t frame_size,
+                        EngineCode & engine_code)
+{
+    NativeCode native;
+    if (!translate(bytecode, frame_size, native))
+        return;
+
+    // Written while writable, then flipped to executable, never both
+    size_t length = native.code.size();
+    void * buffer = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffer == MAP_FAILED)
+        return;
+    memcpy(buffer, native.code.data(), length);
+    if (mprotect(buffer, length, PROT_READ | PROT_EXEC) != 0)
+    {
+        munmap(buffer, length);
+        return;
+    }
+    engine_code.native = buffer;
+    engine_code.native_length = length;
+}
+
+void execute_jit(const BytecodeProgram & bytecode, ExecutionContext & context)
+{
+    vector<int> frame(bytecode.frame_image);
+    int * mem = frame.empty() ? context.mem : frame.data();
+    size_t frame_size = frame.empty() ? context.slot_count : frame.size();
+
+    EngineCode & engine_code = *bytecode.engine_code;
+    call_once(engine_code.native_once, load_native, cref(bytecode), frame_size,
+              ref(engine_code));
+    if (engine_code.native == NULL)
+    {
+        execute_threaded(bytecode, context);
+        return;
+    }
+
+    NativeEntry entry = (NativeEntry) engine_code.native;
+    entry(mem, &context);
+}
+
+EngineCode::~EngineCode()
+{
+    if (native != NULL)
+        munmap(native, native_length);
+}
+
+#else
+
+void execute_jit(const BytecodeProgram & bytecode, ExecutionContext & context)
+{
+    execute_threaded(bytecode, context);
+}
+
+EngineCode::~EngineCode()
+{
+}
+
+#endif
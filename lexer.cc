@@ -32,22 +32,27 @@ void Token::Print()
          << this->line_no << "}\n";
 }
 
-LexicalAnalyzer::LexicalAnalyzer()
+LexicalAnalyzer::LexicalAnalyzer(const char * path)
+{
+    input.Open(path);
+    Start();
+}
+
+LexicalAnalyzer::LexicalAnalyzer(string_view text)
+{
+    input.OpenText(text);
+    Start();
+}
+
+void LexicalAnalyzer::Start()
 {
     this->line_no = 1;
     tmp.lexeme = "";
     tmp.line_no = 1;
     tmp.token_type = ERROR;
-
-    Token token = GetTokenMain();
-    index = 0;
-
-    while (token.token_type != END_OF_FILE)
-    {
-        tokenList.push_back(token);     // push token into internal list
-        token = GetTokenMain();        // and get next token from standatd input
-    }
-    // pushes END_OF_FILE is not pushed on the token list
+    tmp.symbol = -1;
+    lookahead_start = 0;
+    lookahead_count = 0;
 }
 
 bool LexicalAnalyzer::SkipSpace()
@@ -70,9 +75,9 @@ bool LexicalAnalyzer::SkipSpace()
     return space_encountered;
 }
 
-int LexicalAnalyzer::FindKeywordIndex(string s)
+int LexicalAnalyzer::FindKeywordIndex(string_view s)
 {
-    string keyword[] = { "VAR", "FOR", "IF", "WHILE", "SWITCH", "CASE", "DEFAULT", "input", "output", "ARRAY" };
+    static const string_view keyword[] = { "VAR", "FOR", "IF", "WHILE", "SWITCH", "CASE", "DEFAULT", "input", "output", "ARRAY" };
     for (int i = 0; i < KEYWORDS_COUNT; i++) {
         if (s == keyword[i]) {
             return i + 1;
@@ -84,21 +89,19 @@ int LexicalAnalyzer::FindKeywordIndex(string s)
 Token LexicalAnalyzer::ScanNumber()
 {
     char c;
+    size_t start = input.Position();
 
     input.GetChar(c);
     if (isdigit(c)) {
-        if (c == '0') {
-            tmp.lexeme = "0";
-        } else {
-            tmp.lexeme = "";
+        if (c != '0') {
             while (!input.EndOfInput() && isdigit(c)) {
-                tmp.lexeme += c;
                 input.GetChar(c);
             }
             if (!input.EndOfInput()) {
                 input.UngetChar(c);
             }
         }
+        tmp.lexeme = input.Text(start, input.Position());
         tmp.token_type = NUM;
         tmp.line_no = line_no;
         return tmp;
@@ -116,23 +119,25 @@ Token LexicalAnalyzer::ScanNumber()
 Token LexicalAnalyzer::ScanIdOrKeyword()
 {
     char c;
+    size_t start = input.Position();
     input.GetChar(c);
 
     if (isalpha(c)) {
-        tmp.lexeme = "";
         while (!input.EndOfInput() && isalnum(c)) {
-            tmp.lexeme += c;
             input.GetChar(c);
         }
         if (!input.EndOfInput()) {
             input.UngetChar(c);
         }
+        tmp.lexeme = input.Text(start, input.Position());
         tmp.line_no = line_no;
         int keywordIndex = FindKeywordIndex(tmp.lexeme);
         if (keywordIndex != -1)
             tmp.token_type = (TokenType) keywordIndex;
-        else
+        else {
             tmp.token_type = ID;
+            tmp.symbol = symbols.Intern(tmp.lexeme);
+        }
     } else {
         if (!input.EndOfInput()) {
             input.UngetChar(c);
@@ -143,20 +148,17 @@ Token LexicalAnalyzer::ScanIdOrKeyword()
     return tmp;
 }
 
-// GetToken() accesses tokens from the tokenList that is populated when a 
-// lexer object is instantiated
+// GetToken() returns a token that was scanned by an earlier peek() or
+// scans the next one from the input. Once the input is exhausted every
+// call returns END_OF_FILE.
 Token LexicalAnalyzer::GetToken()
 {
-    Token token;
-    if (index == tokenList.size()){       // return end of file if
-        token.lexeme = "";                // index is too large
-        token.line_no = line_no;
-        token.token_type = END_OF_FILE;
-    }
-    else{
-        token = tokenList[index];
-        index = index + 1;
-    }
+    if (lookahead_count == 0)
+        return GetTokenMain();
+
+    Token token = lookahead[lookahead_start];
+    lookahead_start = (lookahead_start + 1) % LOOKAHEAD;
+    lookahead_count--;
     return token;
 }
 
@@ -168,15 +170,26 @@ Token LexicalAnalyzer::peek(int howFar)
         exit(-1);
     }
 
-    int peekIndex = index + howFar - 1;
-    if (peekIndex > (int)(tokenList.size())-1) { // if peeking too far
-        Token token;                        // return END_OF_FILE
-        token.lexeme = "";
-        token.line_no = line_no;
-        token.token_type = END_OF_FILE;
-        return token;
-    } else
-        return tokenList[peekIndex];
+    if (howFar > LOOKAHEAD) {
+        cout << "LexicalAnalyzer:peek:Error: cannot look more than "
+             << LOOKAHEAD << " tokens ahead\n";
+        exit(-1);
+    }
+
+    while (lookahead_count < howFar) {
+        int slot = (lookahead_start + lookahead_count) % LOOKAHEAD;
+        lookahead_position[slot] = input.Position();
+        lookahead[slot] = GetTokenMain();
+        lookahead_count++;
+    }
+    return lookahead[(lookahead_start + howFar - 1) % LOOKAHEAD];
+}
+
+string_view LexicalAnalyzer::Rest()
+{
+    if (lookahead_count > 0)
+        return input.From(lookahead_position[lookahead_start]);
+    return input.Unread();
 }
 
 Token LexicalAnalyzer::GetTokenMain()
@@ -187,6 +200,7 @@ Token LexicalAnalyzer::GetTokenMain()
     tmp.lexeme = "";
     tmp.line_no = line_no;
     tmp.token_type = END_OF_FILE;
+    tmp.symbol = -1;
     if (!input.EndOfInput())
         input.GetChar(c);
     else
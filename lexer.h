@@ -8,8 +8,10 @@
 
 #include <vector>
 #include <string>
+#include <string_view>
 
 #include "inputbuf.h"
+#include "symbols.h"
 
 // ------- token types -------------------
 
@@ -26,27 +28,42 @@ class Token {
   public:
     void Print();
 
-    std::string lexeme;
+    std::string_view lexeme;   // points into the lexer's source buffer
     TokenType token_type;
     int line_no;
+    int symbol;                // SymbolTable id for ID tokens, -1 otherwise
 };
 
 class LexicalAnalyzer {
   public:
     Token GetToken();
     Token peek(int);
-    LexicalAnalyzer();
+    // Reads the program from path, or from stdin when path is NULL
+    explicit LexicalAnalyzer(const char * path);
+    // Reads the program from text, which must outlive the analyzer
+    explicit LexicalAnalyzer(std::string_view text);
+
+    // Source text from the next unconsumed token on, for callers that read
+    // the rest of the input themselves
+    std::string_view Rest();
+
+    // Tokens are scanned on demand, so peek() can look at most this far ahead
+    static const int LOOKAHEAD = 4;
 
   private:
-    std::vector<Token> tokenList;
+    Token lookahead[LOOKAHEAD];     // ring buffer of scanned, unconsumed tokens
+    size_t lookahead_position[LOOKAHEAD];   // where the scan of each one began
+    int lookahead_start;
+    int lookahead_count;
     Token GetTokenMain();
+    void Start();
     int line_no;
-    int index;
     Token tmp;
     InputBuffer input;
+    SymbolTable symbols;
 
     bool SkipSpace();
-    int FindKeywordIndex(std::string);
+    int FindKeywordIndex(std::string_view);
     Token ScanIdOrKeyword();
     Token ScanNumber();
 };
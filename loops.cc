@@ -0,0 +1,636 @@
+#include <algorithm>
+#include <cstdio>
+#include <utility>
+#include <vector>
+
+#include "cfg.h"
+#include "optimizer.h"
+
+using namespace std;
+
+#define LOOP_MAX_BLOCKS (4 * 1024 * 1024)
+
+/*
+ * State of a loop pass while it visits the loops of one graph. The site
+ * arrays describe the loop being visited: every instruction of it, block by
+ * block and in order within a block with the branch last, so comparing two
+ * sites of one block compares their order. The slot-indexed arrays are only
+ * touched for slots the loop uses and are reset after each loop, so visiting
+ * costs the size of the loop and not of the program.
+ */
+struct LoopPass {
+    CompiledProgram * program;
+    ControlFlowGraph * cfg;
+    int loop;                           // index in cfg->loops
+
+    vector<int> position;               // block -> index in loop.blocks, -1 outside
+
+    vector<InstructionNode*> site;
+    vector<int> site_block;
+    vector<bool> removed;
+
+    vector<int> writes;                 // slot -> writes in the loop
+    vector<int> def;                    // slot -> site of its last write
+    vector<int> first_read;             // slot -> first entry of its read chain, -1 none
+    vector<int> read_site;              // per read: the site reading
+    vector<int> next_read;              // per read: next read of the same slot, -1 last
+
+    LiveVariables live;                 // for reduce_induction_variables()
+    int live_blocks;                    // blocks live covers
+
+    int loops_changed;
+    int instructions;
+};
+
+typedef void (*LoopTransform)(LoopPass & pass);
+
+typedef pair<int, InstructionNode*> Insertion;     // site, node to add after it
+
+/*
+ * A loop the loop passes can transform: its header holds nothing but the
+ * CJMP that decides whether to run the body again, and that CJMP is the only
+ * way out. WHILE and FOR loops have this shape.
+ */
+static bool is_simple_loop(const LoopPass & pass, const NaturalLoop & loop)
+{
+    const ControlFlowGraph & cfg = *pass.cfg;
+    const BasicBlock & header = cfg.blocks[loop.header];
+    if (header.branch == NULL || !header.code.empty())
+        return false;
+    if (header.next < 0 || pass.position[header.next] < 0 ||
+        header.target < 0 || pass.position[header.target] >= 0)
+        return false;
+
+    for (size_t k = 0; k < loop.blocks.size(); k++)
+    {
+        const BasicBlock & block = cfg.blocks[loop.blocks[k]];
+        if (loop.blocks[k] == loop.header)
+            continue;
+        if (block.next < 0 || (block.branch != NULL && block.target < 0))
+            return false;
+        for (size_t s = 0; s < block.successors.size(); s++)
+            if (pass.position[block.successors[s]] < 0)
+                return false;
+    }
+    return true;
+}
+
+// Fills the site arrays for loop
+static void collect_sites(LoopPass & pass, const NaturalLoop & loop)
+{
+    const ControlFlowGraph & cfg = *pass.cfg;
+    pass.site.clear();
+    pass.site_block.clear();
+    pass.read_site.clear();
+    pass.next_read.clear();
+
+    for (size_t k = 0; k < loop.blocks.size(); k++)
+    {
+        const BasicBlock & block = cfg.blocks[loop.blocks[k]];
+        int size = block.code.size();
+        for (int i = 0; i <= size; i++)
+        {
+            InstructionNode* node = (i < size) ? block.code[i] : block.branch;
+            if (node == NULL)
+                continue;
+            int s = pass.site.size();
+            pass.site.push_back(node);
+            pass.site_block.push_back(loop.blocks[k]);
+
+            int slot = instruction_writes(node);
+            if (slot >= 0)
+            {
+                pass.writes[slot]++;
+                pass.def[slot] = s;
+            }
+            int reads[2];
+            int read_count = instruction_reads(node, reads);
+            for (int r = 0; r < read_count; r++)
+            {
+                if (r == 1 && reads[1] == reads[0])
+                    continue;
+                pass.read_site.push_back(s);
+                pass.next_read.push_back(pass.first_read[reads[r]]);
+                pass.first_read[reads[r]] = pass.read_site.size() - 1;
+            }
+        }
+    }
+    pass.removed.assign(pass.site.size(), false);
+}
+
+// Resets the slot-indexed arrays for the slots the sites use
+static void release_sites(LoopPass & pass)
+{
+    for (size_t s = 0; s < pass.site.size(); s++)
+    {
+        int slot = instruction_writes(pass.site[s]);
+        if (slot >= 0)
+            pass.writes[slot] = 0;
+        int reads[2];
+        int read_count = instruction_reads(pass.site[s], reads);
+        for (int r = 0; r < read_count; r++)
+            pass.first_read[reads[r]] = -1;
+    }
+}
+
+/*
+ * Writes the sites back into the blocks of loop, leaving out removed ones
+ * and placing each node of inserted, which must be sorted by site, right
+ * after its site.
+ */
+static void rebuild_blocks(LoopPass & pass, const NaturalLoop & loop,
+                           const vector<Insertion> & inserted)
+{
+    ControlFlowGraph & cfg = *pass.cfg;
+    for (size_t k = 0; k < loop.blocks.size(); k++)
+        cfg.blocks[loop.blocks[k]].code.clear();
+
+    size_t next = 0;
+    for (size_t s = 0; s < pass.site.size(); s++)
+    {
+        BasicBlock & block = cfg.blocks[pass.site_block[s]];
+        if (!pass.removed[s] && pass.site[s] != block.branch)
+            block.code.push_back(pass.site[s]);
+        for (; next < inserted.size() && inserted[next].first == (int) s; next++)
+            block.code.push_back(inserted[next].second);
+    }
+}
+
+// True if every read of slot in the loop comes after site, in its block or
+// in a block it dominates, so no read sees a value from before it
+static bool dominates_reads(const LoopPass & pass, int site, int slot)
+{
+    int block = pass.site_block[site];
+    for (int r = pass.first_read[slot]; r >= 0; r = pass.next_read[r])
+    {
+        int reader = pass.read_site[r];
+        if (pass.site_block[reader] == block ? reader <= site
+                                             : !pass.cfg->Dominates(block, pass.site_block[reader]))
+            return false;
+    }
+    return true;
+}
+
+/*
+ * Adds a preheader in front of the loop and returns it:
+ *
+ *   header: CJMP c -> exit          guard:  CJMP c -> exit   (old header)
+ *           body ...         =>     pre:
+ *           JMP header              header: CJMP c -> exit
+ *                                           body ...
+ *                                           JMP header
+ *
+ * The guard repeats the loop test, so code placed in the preheader only runs
+ * when the body runs at least once. Edges from outside keep going to the old
+ * header block, which becomes the guard; the latches move to the new header.
+ */
+static int insert_preheader(LoopPass & pass, const NaturalLoop & loop)
+{
+    ControlFlowGraph & cfg = *pass.cfg;
+    int guard = loop.header;
+    int preheader = cfg.InsertBlock(guard);
+    int header = cfg.InsertBlock(preheader);
+
+    BasicBlock & old_header = cfg.blocks[guard];
+    cfg.blocks[header].branch = old_header.branch;
+    cfg.blocks[header].next = old_header.next;
+    cfg.blocks[header].target = old_header.target;
+
+    InstructionNode* test = pass.program->arena.NewInstruction(CJMP);
+    test->cjmp_inst = old_header.branch->cjmp_inst;
+    test->line_no = old_header.branch->line_no;
+    old_header.branch = test;
+    old_header.next = preheader;
+    cfg.blocks[preheader].next = header;
+
+    for (size_t k = 0; k < loop.blocks.size(); k++)
+    {
+        BasicBlock & block = cfg.blocks[loop.blocks[k]];
+        if (loop.blocks[k] == guard)
+            continue;
+        if (block.next == guard)
+            block.next = header;
+        if (block.target == guard)
+            block.target = header;
+    }
+    return preheader;
+}
+
+// The block that always runs right before the loop is entered, -1 if there
+// is none
+static int find_preheader(const LoopPass & pass, const NaturalLoop & loop)
+{
+    const BasicBlock & header = pass.cfg->blocks[loop.header];
+    int preheader = -1;
+    for (size_t p = 0; p < header.predecessors.size(); p++)
+    {
+        int pred = header.predecessors[p];
+        if (pass.position[pred] >= 0)
+            continue;
+        if (preheader >= 0)
+            return -1;
+        preheader = pred;
+    }
+    if (preheader < 0 || pass.cfg->blocks[preheader].branch != NULL)
+        return -1;
+    return preheader;
+}
+
+// Whether some edge goes back in the reverse postorder. Every loop needs
+// one, so without it the dominator analysis can be skipped.
+static bool has_retreating_edge(const ControlFlowGraph & cfg)
+{
+    vector<int> position(cfg.blocks.size(), -1);
+    for (size_t k = 0; k < cfg.reverse_postorder.size(); k++)
+        position[cfg.reverse_postorder[k]] = k;
+
+    for (size_t k = 0; k < cfg.reverse_postorder.size(); k++)
+    {
+        const BasicBlock & block = cfg.blocks[cfg.reverse_postorder[k]];
+        for (size_t s = 0; s < block.successors.size(); s++)
+            if (position[block.successors[s]] <= (int) k)
+                return true;
+    }
+    return false;
+}
+
+/*
+ * Calls transform on every simple loop, innermost loops first. A transform
+ * that adds blocks adds them to every loop around the one it changed, so
+ * those wait for the analysis to be redone; loops beside it are unaffected
+ * and are visited in the same round. Returns false if the loops are nested
+ * too deeply to analyze.
+ */
+static bool visit_loops(LoopPass & pass, LoopTransform transform)
+{
+    ControlFlowGraph & cfg = *pass.cfg;
+    int slots = pass.program->memory_image.size();
+    pass.writes.assign(slots, 0);
+    pass.def.assign(slots, -1);
+    pass.first_read.assign(slots, -1);
+    pass.loops_changed = pass.instructions = 0;
+    if (!has_retreating_edge(cfg))
+        return true;
+
+    vector<bool> visited;       // headers already visited, by block
+    bool first = true, changed = true;
+    while (changed)
+    {
+        changed = false;
+        if (!cfg.Analyze(LOOP_MAX_BLOCKS))
+            return !first;
+        first = false;
+        visited.resize(cfg.blocks.size(), false);
+        pass.position.assign(cfg.blocks.size(), -1);
+        vector<bool> stale(cfg.loops.size(), false);
+
+        for (int l = cfg.loops.size() - 1; l >= 0; l--)
+        {
+            const NaturalLoop & loop = cfg.loops[l];
+            if (stale[l] || visited[loop.header])
+                continue;
+            visited[loop.header] = true;
+
+            for (size_t k = 0; k < loop.blocks.size(); k++)
+                pass.position[loop.blocks[k]] = k;
+            int count = cfg.blocks.size();
+            if (is_simple_loop(pass, loop))
+            {
+                pass.loop = l;
+                transform(pass);
+            }
+            for (size_t k = 0; k < loop.blocks.size(); k++)
+                pass.position[loop.blocks[k]] = -1;
+            if ((int) cfg.blocks.size() == count)
+                continue;
+
+            pass.position.resize(cfg.blocks.size(), -1);
+            visited.resize(cfg.blocks.size(), true);
+            for (int p = loop.parent; p >= 0 && !stale[p]; p = cfg.loops[p].parent)
+            {
+                stale[p] = true;
+                visited[cfg.loops[p].header] = false;
+            }
+            changed = true;
+        }
+        if (changed)
+            cfg.Connect();
+    }
+    return true;
+}
+
+/*
+ * Moves the assignments of the loop that compute the same value on every
+ * iteration into a guarded preheader, in an order in which they can run. An
+ * assignment x = y op z qualifies when
+ *  - its block dominates every latch, so each completed iteration runs it,
+ *  - y and z are constants or not written in the loop, or only by
+ *    assignments already chosen,
+ *  - it is the only write to x in the loop,
+ *  - it dominates every read of x in the loop, so no read sees an older x,
+ *  - it cannot fault.
+ */
+static void hoist_loop(LoopPass & pass)
+{
+    ControlFlowGraph & cfg = *pass.cfg;
+    const NaturalLoop & loop = cfg.loops[pass.loop];
+    collect_sites(pass, loop);
+
+    vector<bool> every_iteration(loop.blocks.size(), true);
+    for (size_t k = 0; k < loop.blocks.size(); k++)
+        for (size_t l = 0; l < loop.latches.size(); l++)
+            if (!cfg.Dominates(loop.blocks[k], loop.latches[l]))
+                every_iteration[k] = false;
+
+    vector<InstructionNode*> hoisted;
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+        for (size_t s = 0; s < pass.site.size(); s++)
+        {
+            InstructionNode* node = pass.site[s];
+            if (pass.removed[s] || node->type != ASSIGN ||
+                !every_iteration[pass.position[pass.site_block[s]]] ||
+                assignment_may_fault(*pass.program, node))
+                continue;
+            int lhs = node->assign_inst.left_hand_side_index;
+            if (pass.writes[lhs] != 1)
+                continue;
+
+            int reads[2];
+            int read_count = instruction_reads(node, reads);
+            bool invariant = true;
+            for (int r = 0; r < read_count; r++)
+                if (pass.writes[reads[r]] != 0)
+                    invariant = false;
+            if (!invariant || !dominates_reads(pass, s, lhs))
+                continue;
+
+            hoisted.push_back(node);
+            pass.removed[s] = true;
+            pass.writes[lhs] = 0;
+            changed = true;
+        }
+    }
+
+    release_sites(pass);
+    if (hoisted.empty())
+        return;
+    rebuild_blocks(pass, loop, vector<Insertion>());
+    int preheader = insert_preheader(pass, loop);
+    cfg.blocks[preheader].code = hoisted;
+    pass.instructions += hoisted.size();
+    pass.loops_changed++;
+}
+
+int hoist_loop_invariants(CompiledProgram & program, ControlFlowGraph & cfg, FILE * report)
+{
+    LoopPass pass;
+    pass.program = &program;
+    pass.cfg = &cfg;
+    if (!visit_loops(pass, hoist_loop))
+    {
+        if (report != NULL)
+            fprintf(report, "licm: skipped, loops nested too deeply\n");
+        return 0;
+    }
+    if (report != NULL)
+        fprintf(report, "licm: hoisted %d assignments out of %d loops\n",
+                pass.instructions, pass.loops_changed);
+    return pass.instructions;
+}
+
+static InstructionNode* new_assign(CompiledProgram & program, int lhs, int operand1,
+                                   ArithmeticOperatorType op, int operand2, int line_no)
+{
+    InstructionNode* node = program.arena.NewInstruction(ASSIGN);
+    node->line_no = line_no;
+    node->assign_inst.left_hand_side_index = lhs;
+    node->assign_inst.operand1_index = operand1;
+    node->assign_inst.op = op;
+    node->assign_inst.operand2_index = operand2;
+    return node;
+}
+
+/*
+ * If site is i = i + c, i = c + i or i = i - c with c invariant, stores c
+ * in step and the operator that applies it in op.
+ */
+static bool is_induction_step(const LoopPass & pass, int site, int & step,
+                              ArithmeticOperatorType & op)
+{
+    InstructionNode* node = pass.site[site];
+    if (node->type != ASSIGN)
+        return false;
+    int i = node->assign_inst.left_hand_side_index;
+    int a = node->assign_inst.operand1_index;
+    int b = node->assign_inst.operand2_index;
+    op = node->assign_inst.op;
+    if ((op == OPERATOR_PLUS || op == OPERATOR_MINUS) && a == i && b != i)
+        step = b;
+    else if (op == OPERATOR_PLUS && b == i && a != i)
+        step = a;
+    else
+        return false;
+    return pass.writes[step] == 0;
+}
+
+/*
+ * Marks, by position in the loop, the blocks that can run after block in
+ * the same iteration, that is without passing the header again. cached
+ * remembers the block after was last filled for.
+ */
+static void blocks_after(const LoopPass & pass, const NaturalLoop & loop, int block,
+                         vector<bool> & after, int & cached)
+{
+    if (cached == block)
+        return;
+    cached = block;
+
+    const ControlFlowGraph & cfg = *pass.cfg;
+    after.assign(loop.blocks.size(), false);
+    vector<int> worklist(1, block);
+    while (!worklist.empty())
+    {
+        const BasicBlock & b = cfg.blocks[worklist.back()];
+        worklist.pop_back();
+        int edges[2] = { b.next, (b.branch != NULL) ? b.target : -1 };
+        for (int e = 0; e < 2; e++)
+        {
+            int to = edges[e];
+            if (to < 0 || to == loop.header || pass.position[to] < 0 || after[pass.position[to]])
+                continue;
+            after[pass.position[to]] = true;
+            worklist.push_back(to);
+        }
+    }
+}
+
+static bool earlier_site(const Insertion & a, const Insertion & b)
+{
+    return a.first < b.first;
+}
+
+/*
+ * Strength reduction. For a basic induction variable i, whose only write in
+ * the loop is i = i +- c with c invariant, and x = i * k with k invariant,
+ * x = i * k can be kept true throughout the loop: it is computed once in the
+ * preheader and x = x +- c * k follows the write to i. The multiplication
+ * becomes an addition and x becomes an induction variable itself, so x * m
+ * is reduced on the next round.
+ *
+ * x then changes where i does rather than at the multiplication, so the
+ * multiplication must be x's only write in the loop and come before every
+ * read of x, and when the write to i can follow it in an iteration, no read
+ * of x may follow that write. x also ends up different after the loop, so
+ * it must be dead there. Both writes must be outside inner loops, so that
+ * neither runs twice in one iteration.
+ */
+static void reduce_loop(LoopPass & pass)
+{
+    CompiledProgram & program = *pass.program;
+    ControlFlowGraph & cfg = *pass.cfg;
+    const NaturalLoop & loop = cfg.loops[pass.loop];
+    int exit = cfg.blocks[loop.header].target;
+    int preheader = find_preheader(pass, loop);
+    vector<InstructionNode*> setup;     // goes at the end of the preheader
+    vector<bool> after_multiply, after_update;
+    int multiply_block = -1, update_block = -1;
+    int reduced = 0;
+
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+        collect_sites(pass, loop);
+        vector<Insertion> inserted;
+
+        for (size_t s = 0; s < pass.site.size(); s++)
+        {
+            InstructionNode* node = pass.site[s];
+            if (node->type != ASSIGN || node->assign_inst.op != OPERATOR_MULT ||
+                cfg.blocks[pass.site_block[s]].loop != pass.loop)
+                continue;
+            // Slots made by reductions of inner loops are newer than the
+            // liveness solution; such an x counts as live after the loop
+            int x = node->assign_inst.left_hand_side_index;
+            if (pass.writes[x] != 1 || exit >= pass.live_blocks ||
+                x >= (int) pass.live.bit.size() || pass.live.LiveIn(exit, x))
+                continue;
+
+            // Either operand may be the induction variable
+            int k = -1, c = -1, update = -1;
+            ArithmeticOperatorType op = OPERATOR_PLUS;
+            for (int o = 0; o < 2 && update < 0; o++)
+            {
+                int i = o ? node->assign_inst.operand2_index : node->assign_inst.operand1_index;
+                k = o ? node->assign_inst.operand1_index : node->assign_inst.operand2_index;
+                if (i == x || pass.writes[i] != 1 || pass.writes[k] != 0)
+                    continue;
+                int d = pass.def[i];
+                if (!pass.removed[d] && cfg.blocks[pass.site_block[d]].loop == pass.loop &&
+                    is_induction_step(pass, d, c, op))
+                    update = d;
+            }
+            if (update < 0 || !dominates_reads(pass, s, x))
+                continue;
+
+            bool update_follows;
+            if (pass.site_block[update] == pass.site_block[s])
+                update_follows = update > (int) s;
+            else
+            {
+                blocks_after(pass, loop, pass.site_block[s], after_multiply, multiply_block);
+                update_follows = after_multiply[pass.position[pass.site_block[update]]];
+            }
+            bool read_follows = false;
+            if (update_follows)
+            {
+                blocks_after(pass, loop, pass.site_block[update], after_update, update_block);
+                for (int r = pass.first_read[x]; r >= 0 && !read_follows; r = pass.next_read[r])
+                {
+                    int reader = pass.read_site[r];
+                    read_follows = (pass.site_block[reader] == pass.site_block[update])
+                                   ? reader > update
+                                   : after_update[pass.position[pass.site_block[reader]]];
+                }
+            }
+            if (read_follows)
+                continue;
+
+            // The amount x moves by when i moves by c
+            int step;
+            if (program.is_constant[c] && program.is_constant[k])
+                step = program.ConstantSlot((int) ((unsigned) program.memory_image[c] *
+                                                   (unsigned) program.memory_image[k]));
+            else if (program.is_constant[c] && program.memory_image[c] == 1)
+                step = k;
+            else if (program.is_constant[k] && program.memory_image[k] == 1)
+                step = c;
+            else
+            {
+                step = program.memory_image.size();
+                program.memory_image.push_back(0);
+                program.is_constant.push_back(false);
+                pass.writes.push_back(0);
+                pass.def.push_back(-1);
+                pass.first_read.push_back(-1);
+                setup.push_back(new_assign(program, step, c, OPERATOR_MULT, k, node->line_no));
+            }
+            if (step >= (int) pass.writes.size())
+            {
+                // A new constant slot
+                pass.writes.resize(step + 1, 0);
+                pass.def.resize(step + 1, -1);
+                pass.first_read.resize(step + 1, -1);
+            }
+
+            setup.push_back(node);
+            pass.removed[s] = true;
+            inserted.push_back(Insertion(update, new_assign(program, x, x, op, step, node->line_no)));
+            reduced++;
+            changed = true;
+        }
+
+        release_sites(pass);
+        if (changed)
+        {
+            stable_sort(inserted.begin(), inserted.end(), earlier_site);
+            rebuild_blocks(pass, loop, inserted);
+        }
+    }
+
+    if (reduced == 0)
+        return;
+    if (preheader < 0)
+        preheader = insert_preheader(pass, loop);
+    BasicBlock & block = cfg.blocks[preheader];
+    block.code.insert(block.code.end(), setup.begin(), setup.end());
+    pass.instructions += reduced;
+    pass.loops_changed++;
+}
+
+int reduce_induction_variables(CompiledProgram & program, ControlFlowGraph & cfg, FILE * report)
+{
+    LoopPass pass;
+    pass.program = &program;
+    pass.cfg = &cfg;
+    pass.live_blocks = cfg.blocks.size();
+    if (has_retreating_edge(cfg) && !compute_liveness(program, cfg, pass.live))
+    {
+        if (report != NULL)
+            fprintf(report, "strength: skipped, too many variables for liveness\n");
+        return 0;
+    }
+    if (!visit_loops(pass, reduce_loop))
+    {
+        if (report != NULL)
+            fprintf(report, "strength: skipped, loops nested too deeply\n");
+        return 0;
+    }
+    if (report != NULL)
+        fprintf(report, "strength: reduced %d multiplications in %d loops\n",
+                pass.instructions, pass.loops_changed);
+    return pass.instructions;
+}
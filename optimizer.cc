@@ -0,0 +1,632 @@
+#include <climits>
+#include <cstdio>
+#include <algorithm>
+#include <functional>
+#include <queue>
+#include <cstdint>
+#include <vector>
+
+#include "optimizer.h"
+
+using namespace std;
+
+ConditionalOperatorType negate_condition(ConditionalOperatorType condition)
+{
+    switch (condition)
+    {
+        case CONDITION_GREATER:       return CONDITION_LESS_EQUAL;
+        case CONDITION_LESS:          return CONDITION_GREATER_EQUAL;
+        case CONDITION_NOTEQUAL:      return CONDITION_EQUAL;
+        case CONDITION_EQUAL:         return CONDITION_NOTEQUAL;
+        case CONDITION_GREATER_EQUAL: return CONDITION_LESS;
+        default:                      return CONDITION_GREATER;
+    }
+}
+
+int optimize_peephole(CompiledProgram & program, LinearCode & linear, FILE * report)
+{
+    vector<InstructionNode*> & code = linear.code;
+    vector<int> & target = linear.target;
+    int before = code.size();
+
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+        int n = code.size();
+
+        // live[k] is the first instruction at or after k that is not a NOOP
+        vector<int> live(n + 1, n);
+        for (int k = n - 1; k >= 0; k--)
+            live[k] = (code[k]->type == NOOP) ? live[k + 1] : k;
+
+        // Thread every jump through NOOPs and JMPs to its final destination.
+        // A destination past the end is the trailing NOOP that halts.
+        for (int i = 0; i < n; i++)
+        {
+            if (target[i] < 0)
+                continue;
+            int k = live[target[i]];
+            for (int steps = 0; k < n && code[k]->type == JMP && steps < n; steps++)
+            {
+                int next = live[target[k]];
+                if (next == k)
+                    break;
+                k = next;
+            }
+            if (k == n)
+                k = n - 1;
+            if (k != target[i])
+            {
+                target[i] = k;
+                changed = true;
+            }
+        }
+
+        vector<int> referenced(n, 0);
+        for (int i = 0; i < n; i++)
+            if (target[i] >= 0)
+                referenced[target[i]]++;
+
+        vector<bool> removed(n, false);
+        bool any_removed = false;
+        for (int i = 0; i < n; i++)
+        {
+            InstructionNode* node = code[i];
+            if (removed[i])
+                continue;
+
+            if (node->type == NOOP)
+            {
+                // The trailing NOOP stays while something jumps to it
+                if (i < n - 1 || referenced[i] == 0)
+                    removed[i] = any_removed = true;
+                continue;
+            }
+
+            if (target[i] < 0)
+                continue;
+            int fall_through = live[i + 1];
+            int destination = live[target[i]];
+
+            if (destination == fall_through)
+            {
+                // Both ways lead to the same place
+                removed[i] = any_removed = true;
+                continue;
+            }
+
+            if (node->type == CJMP && fall_through < n &&
+                code[fall_through]->type == JMP && referenced[fall_through] == 0 &&
+                live[fall_through + 1] == destination)
+            {
+                // CJMP c -> L1; JMP L2; L1:   becomes   CJMP !c -> L2; L1:
+                node->cjmp_inst.condition_op = negate_condition(node->cjmp_inst.condition_op);
+                target[i] = target[fall_through];
+                removed[fall_through] = any_removed = true;
+                continue;
+            }
+
+            if (node->type == JMP)
+            {
+                // Nothing after an unconditional jump runs until a label
+                for (int j = i + 1; j < n && referenced[j] == 0; j++)
+                    removed[j] = any_removed = true;
+            }
+        }
+
+        if (any_removed)
+        {
+            remove_instructions(program, linear, removed);
+            changed = true;
+        }
+    }
+
+    int removed = before - (int) code.size();
+    if (report != NULL)
+        fprintf(report, "peephole: removed %d instructions\n", removed);
+    return removed;
+}
+
+#define CONSTPROP_MAX_CELLS (4 * 1024 * 1024)
+
+enum LatticeState {
+    LATTICE_UNDEFINED,      // no path reaching here has been seen yet
+    LATTICE_CONSTANT,
+    LATTICE_VARYING
+};
+
+struct LatticeValue {
+    LatticeState state;
+    int value;              // meaningful for LATTICE_CONSTANT only
+};
+
+static LatticeValue lattice_constant(int value)
+{
+    LatticeValue result = { LATTICE_CONSTANT, value };
+    return result;
+}
+
+static LatticeValue lattice_varying()
+{
+    LatticeValue result = { LATTICE_VARYING, 0 };
+    return result;
+}
+
+/*
+ * Per-slot lattice state during propagation. Only slots written by some
+ * ASSIGN or IN are tracked; every other slot keeps its memory_image value
+ * for the whole run.
+ */
+struct ConstantState {
+    const CompiledProgram * program;
+    vector<int> tracked;    // slot -> index into a block state, -1 = fixed
+
+    int Track(int slot) const
+    {
+        return slot < (int) tracked.size() ? tracked[slot] : -1;
+    }
+
+    LatticeValue Value(const LatticeValue * cells, int slot) const
+    {
+        int t = Track(slot);
+        return t < 0 ? lattice_constant(program->memory_image[slot]) : cells[t];
+    }
+};
+
+// Same arithmetic as the engines, without the undefined behavior. Returns
+// false when the runtime would fault.
+static bool fold_arithmetic(ArithmeticOperatorType op, int a, int b, int & result)
+{
+    switch (op)
+    {
+        case OPERATOR_PLUS:  result = (int) ((unsigned) a + (unsigned) b); return true;
+        case OPERATOR_MINUS: result = (int) ((unsigned) a - (unsigned) b); return true;
+        case OPERATOR_MULT:  result = (int) ((unsigned) a * (unsigned) b); return true;
+        case OPERATOR_DIV:
+            if (b == 0 || (a == INT_MIN && b == -1))
+                return false;
+            result = a / b;
+            return true;
+        default:
+            result = a;
+            return true;
+    }
+}
+
+static bool fold_condition(ConditionalOperatorType condition, int a, int b)
+{
+    switch (condition)
+    {
+        case CONDITION_GREATER:       return a > b;
+        case CONDITION_LESS:          return a < b;
+        case CONDITION_NOTEQUAL:      return a != b;
+        case CONDITION_EQUAL:         return a == b;
+        case CONDITION_GREATER_EQUAL: return a >= b;
+        default:                      return a <= b;
+    }
+}
+
+static LatticeValue evaluate_assign(const ConstantState & state, const LatticeValue * cells,
+                                    InstructionNode * node)
+{
+    LatticeValue a = state.Value(cells, node->assign_inst.operand1_index);
+    if (node->assign_inst.op == OPERATOR_NONE)
+        return a;
+
+    LatticeValue b = state.Value(cells, node->assign_inst.operand2_index);
+    if (a.state == LATTICE_UNDEFINED || b.state == LATTICE_UNDEFINED)
+    {
+        LatticeValue undefined = { LATTICE_UNDEFINED, 0 };
+        return undefined;
+    }
+    int result;
+    if (a.state == LATTICE_CONSTANT && b.state == LATTICE_CONSTANT &&
+        fold_arithmetic(node->assign_inst.op, a.value, b.value, result))
+        return lattice_constant(result);
+    return lattice_varying();
+}
+
+static void transfer(const ConstantState & state, LatticeValue * cells, InstructionNode * node)
+{
+    int t;
+    if (node->type == ASSIGN && (t = state.Track(node->assign_inst.left_hand_side_index)) >= 0)
+        cells[t] = evaluate_assign(state, cells, node);
+    else if (node->type == IN && (t = state.Track(node->input_inst.var_index)) >= 0)
+        cells[t] = lattice_varying();
+}
+
+// Meets from into to; returns true if to changed
+static bool meet(LatticeValue * to, const LatticeValue * from, int count)
+{
+    bool changed = false;
+    for (int t = 0; t < count; t++)
+    {
+        if (from[t].state == LATTICE_UNDEFINED || to[t].state == LATTICE_VARYING)
+            continue;
+        if (to[t].state == LATTICE_UNDEFINED)
+            to[t] = from[t];
+        else if (from[t].state == LATTICE_VARYING || from[t].value != to[t].value)
+            to[t] = lattice_varying();
+        else
+            continue;
+        changed = true;
+    }
+    return changed;
+}
+
+// Replaces a known variable operand with the constant slot for its value
+static bool substitute_operand(CompiledProgram & program, const ConstantState & state,
+                               const LatticeValue * cells, int & slot)
+{
+    if (state.Track(slot) < 0)
+        return false;
+    LatticeValue value = state.Value(cells, slot);
+    if (value.state != LATTICE_CONSTANT)
+        return false;
+    slot = program.ConstantSlot(value.value);
+    return true;
+}
+
+int propagate_constants(CompiledProgram & program, ControlFlowGraph & cfg, FILE * report)
+{
+    vector<BasicBlock> & blocks = cfg.blocks;
+    int block_count = blocks.size();
+
+    ConstantState state;
+    state.program = &program;
+    state.tracked.assign(program.memory_image.size(), -1);
+    int count = 0;
+    for (int b = 0; b < block_count; b++)
+    {
+        for (size_t i = 0; i < blocks[b].code.size(); i++)
+        {
+            InstructionNode* node = blocks[b].code[i];
+            int slot = instruction_writes(node);
+            if (slot >= 0 && state.tracked[slot] < 0)
+                state.tracked[slot] = count++;
+        }
+    }
+
+    if ((long long) block_count * count > CONSTPROP_MAX_CELLS)
+    {
+        if (report != NULL)
+            fprintf(report, "constprop: skipped, %d blocks x %d variables is too large\n",
+                    block_count, count);
+        return 0;
+    }
+
+    vector<LatticeValue> in((size_t) block_count * count);
+    vector<bool> reachable(block_count, false);
+    vector<bool> queued(block_count, false);
+    vector<LatticeValue> cells(count);
+    priority_queue<int, vector<int>, greater<int> > worklist;
+
+    for (int slot = 0; slot < (int) state.tracked.size(); slot++)
+        if (state.tracked[slot] >= 0)
+            in[state.tracked[slot]] = lattice_constant(program.memory_image[slot]);
+    reachable[0] = true;
+    queued[0] = true;
+    worklist.push(0);
+
+    while (!worklist.empty())
+    {
+        int b = worklist.top();
+        worklist.pop();
+        queued[b] = false;
+
+        const BasicBlock & block = blocks[b];
+        copy(in.begin() + (size_t) b * count, in.begin() + (size_t) (b + 1) * count, cells.begin());
+        for (size_t i = 0; i < block.code.size(); i++)
+            transfer(state, cells.data(), block.code[i]);
+
+        // Feasible successors of the block
+        int successors[2];
+        int successor_count = 0;
+        bool falls = block.next >= 0;
+        bool jumps = block.branch != NULL;
+        if (block.branch != NULL)
+        {
+            LatticeValue a = state.Value(cells.data(), block.branch->cjmp_inst.operand1_index);
+            LatticeValue c = state.Value(cells.data(), block.branch->cjmp_inst.operand2_index);
+            if (a.state == LATTICE_UNDEFINED || c.state == LATTICE_UNDEFINED)
+                falls = jumps = false;
+            else if (a.state == LATTICE_CONSTANT && c.state == LATTICE_CONSTANT)
+            {
+                bool taken = !fold_condition(block.branch->cjmp_inst.condition_op, a.value, c.value);
+                falls = falls && !taken;
+                jumps = taken;
+            }
+        }
+        if (falls)
+            successors[successor_count++] = block.next;
+        if (jumps)
+            successors[successor_count++] = block.target;
+
+        for (int k = 0; k < successor_count; k++)
+        {
+            int s = successors[k];
+            LatticeValue* target_in = &in[(size_t) s * count];
+            bool changed;
+            if (!reachable[s])
+            {
+                copy(cells.begin(), cells.end(), target_in);
+                reachable[s] = true;
+                changed = true;
+            }
+            else
+            {
+                changed = meet(target_in, cells.data(), count);
+            }
+            if (changed && !queued[s])
+            {
+                queued[s] = true;
+                worklist.push(s);
+            }
+        }
+    }
+
+    // Rewrite with the final state of every block
+    int before = cfg.InstructionCount();
+    int folded = 0, resolved = 0, unreachable = 0;
+    for (int b = 0; b < block_count; b++)
+    {
+        BasicBlock & block = blocks[b];
+        if (!block.reachable)
+            continue;
+        if (!reachable[b])
+        {
+            unreachable += block.code.size() + (block.branch != NULL);
+            continue;
+        }
+
+        copy(in.begin() + (size_t) b * count, in.begin() + (size_t) (b + 1) * count, cells.begin());
+        for (size_t i = 0; i < block.code.size(); i++)
+        {
+            InstructionNode* node = block.code[i];
+            if (node->type == ASSIGN)
+            {
+                LatticeValue result = evaluate_assign(state, cells.data(), node);
+                if (result.state == LATTICE_CONSTANT &&
+                    !(node->assign_inst.op == OPERATOR_NONE &&
+                      state.Track(node->assign_inst.operand1_index) < 0))
+                {
+                    node->assign_inst.operand1_index = program.ConstantSlot(result.value);
+                    node->assign_inst.operand2_index = -1;
+                    node->assign_inst.op = OPERATOR_NONE;
+                    folded++;
+                }
+                else
+                {
+                    substitute_operand(program, state, cells.data(), node->assign_inst.operand1_index);
+                    if (node->assign_inst.op != OPERATOR_NONE)
+                        substitute_operand(program, state, cells.data(), node->assign_inst.operand2_index);
+                }
+            }
+            else if (node->type == OUT)
+            {
+                substitute_operand(program, state, cells.data(), node->output_inst.var_index);
+            }
+            transfer(state, cells.data(), node);
+        }
+
+        if (block.branch != NULL)
+        {
+            InstructionNode* node = block.branch;
+            LatticeValue a = state.Value(cells.data(), node->cjmp_inst.operand1_index);
+            LatticeValue c = state.Value(cells.data(), node->cjmp_inst.operand2_index);
+            if (a.state == LATTICE_CONSTANT && c.state == LATTICE_CONSTANT)
+            {
+                if (!fold_condition(node->cjmp_inst.condition_op, a.value, c.value))
+                    block.next = block.target;
+                block.branch = NULL;
+                block.target = -1;
+                resolved++;
+            }
+            else
+            {
+                substitute_operand(program, state, cells.data(), node->cjmp_inst.operand1_index);
+                substitute_operand(program, state, cells.data(), node->cjmp_inst.operand2_index);
+            }
+        }
+    }
+
+    // Blocks only reachable through resolved branches drop out here
+    cfg.Connect();
+    if (report != NULL)
+        fprintf(report, "constprop: folded %d assignments, resolved %d branches, "
+                "removed %d unreachable instructions\n", folded, resolved, unreachable);
+    return before - cfg.InstructionCount();
+}
+
+#define LIVENESS_MAX_WORDS (8 * 1024 * 1024)
+
+bool assignment_may_fault(const CompiledProgram & program, InstructionNode * node)
+{
+    if (node->assign_inst.op != OPERATOR_DIV)
+        return false;
+    int divisor = node->assign_inst.operand2_index;
+    return !program.is_constant[divisor] ||
+           program.memory_image[divisor] == 0 || program.memory_image[divisor] == -1;
+}
+
+/*
+ * Moves set from the end of an instruction to its start. An assignment
+ * whose result is dead does not make its operands live, so chains of dead
+ * assignments go in one pass. Returns false for an assignment that can be
+ * removed.
+ */
+static bool transfer_backward(const LiveVariables & state, uint64_t * set, InstructionNode * node)
+{
+    switch (node->type)
+    {
+        case ASSIGN:
+            if (!state.Test(set, node->assign_inst.left_hand_side_index) &&
+                !assignment_may_fault(*state.program, node))
+                return false;
+            state.Clear(set, node->assign_inst.left_hand_side_index);
+            state.Set(set, node->assign_inst.operand1_index);
+            if (node->assign_inst.op != OPERATOR_NONE)
+                state.Set(set, node->assign_inst.operand2_index);
+            return true;
+        case IN:
+            state.Clear(set, node->input_inst.var_index);
+            return true;
+        case OUT:
+            state.Set(set, node->output_inst.var_index);
+            return true;
+        case CJMP:
+            state.Set(set, node->cjmp_inst.operand1_index);
+            state.Set(set, node->cjmp_inst.operand2_index);
+            return true;
+        default:
+            return true;
+    }
+}
+
+// Union of live_in over the successors of block, which is where its
+// backward scan starts
+static void live_out(const BasicBlock & block, const vector<uint64_t> & live_in, int words,
+                     vector<uint64_t> & set)
+{
+    fill(set.begin(), set.end(), 0);
+    for (size_t k = 0; k < block.successors.size(); k++)
+    {
+        const uint64_t* in = live_in.data() + (size_t) block.successors[k] * words;
+        for (int w = 0; w < words; w++)
+            set[w] |= in[w];
+    }
+}
+
+bool compute_liveness(const CompiledProgram & program, const ControlFlowGraph & cfg,
+                      LiveVariables & state)
+{
+    const vector<BasicBlock> & blocks = cfg.blocks;
+    int block_count = blocks.size();
+
+    state.program = &program;
+    state.bit.assign(program.memory_image.size(), -1);
+    int count = 0;
+    for (int b = 0; b < block_count; b++)
+    {
+        int size = blocks[b].code.size();
+        for (int i = 0; i <= size; i++)
+        {
+            InstructionNode* node = (i < size) ? blocks[b].code[i] : blocks[b].branch;
+            if (node == NULL)
+                continue;
+            int reads[2];
+            int read_count = instruction_reads(node, reads);
+            for (int k = 0; k < read_count; k++)
+                if (!program.is_constant[reads[k]] && state.bit[reads[k]] < 0)
+                    state.bit[reads[k]] = count++;
+        }
+    }
+    state.variables = count;
+    state.words = (count + 63) / 64;
+    state.live_in.clear();
+    if ((long long) block_count * state.words > LIVENESS_MAX_WORDS)
+        return false;
+
+    // live_in of every block; nothing is live when the program halts.
+    // Visiting in postorder settles most blocks on the first sweep.
+    int words = state.words;
+    vector<uint64_t> & live_in = state.live_in;
+    live_in.assign((size_t) block_count * words, 0);
+    vector<uint64_t> set(words);
+    vector<bool> queued(block_count, false);
+    vector<int> worklist(cfg.reverse_postorder);
+    for (size_t k = 0; k < worklist.size(); k++)
+        queued[worklist[k]] = true;
+
+    while (!worklist.empty())
+    {
+        int b = worklist.back();
+        worklist.pop_back();
+        queued[b] = false;
+
+        const BasicBlock & block = blocks[b];
+        live_out(block, live_in, words, set);
+        if (block.branch != NULL)
+            transfer_backward(state, set.data(), block.branch);
+        for (int i = block.code.size() - 1; i >= 0; i--)
+            transfer_backward(state, set.data(), block.code[i]);
+
+        uint64_t* in = live_in.data() + (size_t) b * words;
+        if (equal(set.begin(), set.end(), in))
+            continue;
+        copy(set.begin(), set.end(), in);
+        for (size_t k = 0; k < block.predecessors.size(); k++)
+        {
+            int p = block.predecessors[k];
+            if (!queued[p])
+            {
+                queued[p] = true;
+                worklist.push_back(p);
+            }
+        }
+    }
+    return true;
+}
+
+int eliminate_dead_code(CompiledProgram & program, ControlFlowGraph & cfg, FILE * report)
+{
+    vector<BasicBlock> & blocks = cfg.blocks;
+    int block_count = blocks.size();
+
+    LiveVariables state;
+    if (!compute_liveness(program, cfg, state))
+    {
+        if (report != NULL)
+            fprintf(report, "liveness: skipped, %d blocks x %d variables is too large\n",
+                    block_count, state.variables);
+        return 0;
+    }
+
+    int words = state.words;
+    vector<uint64_t> set(words);
+    int dead = 0;
+    for (int b = 0; b < block_count; b++)
+    {
+        BasicBlock & block = blocks[b];
+        if (!block.reachable)
+            continue;
+        live_out(block, state.live_in, words, set);
+        if (block.branch != NULL)
+            transfer_backward(state, set.data(), block.branch);
+
+        // Walk backwards, then compact the survivors in order
+        vector<bool> keep(block.code.size());
+        for (int i = block.code.size() - 1; i >= 0; i--)
+            keep[i] = transfer_backward(state, set.data(), block.code[i]);
+        size_t kept = 0;
+        for (size_t i = 0; i < block.code.size(); i++)
+            if (keep[i])
+                block.code[kept++] = block.code[i];
+        dead += block.code.size() - kept;
+        block.code.resize(kept);
+    }
+
+    if (report != NULL)
+        fprintf(report, "liveness: removed %d dead assignments\n", dead);
+    return dead;
+}
+
+void optimize_program(CompiledProgram & program, FILE * report)
+{
+    LinearCode linear;
+    ControlFlowGraph cfg;
+
+    linearize_program(program, linear);
+    optimize_peephole(program, linear, report);
+
+    cfg.Build(linear);
+    propagate_constants(program, cfg, report);
+    hoist_loop_invariants(program, cfg, report);
+    reduce_induction_variables(program, cfg, report);
+    eliminate_dead_code(program, cfg, report);
+    cfg.Lower(program, linear);
+
+    optimize_peephole(program, linear, report);
+    store_program(program, linear);
+}
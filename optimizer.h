@@ -0,0 +1,113 @@
+#ifndef _OPTIMIZER_H_
+#define _OPTIMIZER_H_
+
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+#include "cfg.h"
+#include "compiler.h"
+
+ConditionalOperatorType negate_condition(ConditionalOperatorType condition);
+
+// Whether executing an ASSIGN can fault: a division whose divisor is not a
+// constant other than 0 and -1. Such assignments must not be removed or
+// moved to where they run more often.
+bool assignment_may_fault(const CompiledProgram & program, InstructionNode * node);
+
+/*
+ * Each pass below works on the linear form or the control-flow graph of
+ * program, returns the number of instructions it removed, or for the loop
+ * passes moved or rewrote, and, when report is not NULL, writes one line
+ * describing what it did. A pass that changed nothing returns 0.
+ */
+
+/*
+ * Removes NOOPs, retargets jumps to their final destination, deletes jumps
+ * to the next instruction and unreachable code after a JMP, and turns a CJMP
+ * that branches over a JMP into one inverted CJMP.
+ */
+int optimize_peephole(CompiledProgram & program, LinearCode & linear, FILE * report);
+
+/*
+ * Conditional constant propagation over basic blocks. Variables start at
+ * their memory_image value and IN makes a variable unknown. Assignments with
+ * a known result become a copy from a constant slot, known operands are
+ * replaced by constant slots, and CJMPs with a known outcome are dropped in
+ * favor of the edge they always take, which disconnects blocks that can
+ * never run. Division by zero is left for the runtime to report. Programs
+ * whose blocks x variables state would be too large are left alone.
+ */
+int propagate_constants(CompiledProgram & program, ControlFlowGraph & cfg, FILE * report);
+
+/*
+ * Loop-invariant code motion. For each loop that is only left through the
+ * test in its header, assignments that compute the same value on every
+ * iteration are moved into a preheader. The preheader is guarded by a copy
+ * of the loop test, so a loop that never runs its body still writes nothing.
+ * Returns the number of assignments hoisted.
+ */
+int hoist_loop_invariants(CompiledProgram & program, ControlFlowGraph & cfg, FILE * report);
+
+/*
+ * Strength reduction of multiplications by induction variables. In a loop
+ * like the one above, x = i * k where i only changes by i = i +- c and c and
+ * k do not change becomes x = i * k in the preheader and x = x +- c * k
+ * after the write to i. x must be dead after the loop; i itself is left for
+ * eliminate_dead_code() when nothing else reads it. Returns the number of
+ * multiplications rewritten.
+ */
+int reduce_induction_variables(CompiledProgram & program, ControlFlowGraph & cfg, FILE * report);
+
+/*
+ * Variables live on entry to each block of a graph, where a variable is
+ * only observed through OUT and CJMP. Only variables that some instruction
+ * reads get a bit; a write to any other slot is dead by construction.
+ */
+struct LiveVariables {
+    const CompiledProgram * program;
+    std::vector<int> bit;               // slot -> bit index, -1 = never read
+    int variables;                      // bits in use
+    int words;                          // 64-bit words per set
+    std::vector<uint64_t> live_in;      // words per block, by block
+
+    bool Test(const uint64_t * set, int slot) const
+    {
+        int b = bit[slot];
+        return b >= 0 && (set[b >> 6] >> (b & 63) & 1) != 0;
+    }
+    void Set(uint64_t * set, int slot) const
+    {
+        int b = bit[slot];
+        if (b >= 0)
+            set[b >> 6] |= (uint64_t) 1 << (b & 63);
+    }
+    void Clear(uint64_t * set, int slot) const
+    {
+        int b = bit[slot];
+        if (b >= 0)
+            set[b >> 6] &= ~((uint64_t) 1 << (b & 63));
+    }
+    bool LiveIn(int block, int slot) const
+    {
+        return Test(live_in.data() + (size_t) block * words, slot);
+    }
+};
+
+// Solves liveness over cfg into state. Returns false when blocks x
+// variables would be too large.
+bool compute_liveness(const CompiledProgram & program, const ControlFlowGraph & cfg,
+                      LiveVariables & state);
+
+/*
+ * Backward liveness over basic blocks, where a variable is only observed
+ * through OUT and CJMP. Removes assignments whose result is never observed,
+ * including stores overwritten before any read. IN is never removed, since
+ * it consumes input, and neither is a division that could fault.
+ */
+int eliminate_dead_code(CompiledProgram & program, ControlFlowGraph & cfg, FILE * report);
+
+// Linearizes program, runs every pass in order and stores the result
+void optimize_program(CompiledProgram & program, FILE * report);
+
+#endif /* _OPTIMIZER_H_ */
@@ -0,0 +1,254 @@
+#include <cstdlib>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "profile.h"
+
+using namespace std;
+
+static int assign_result(InstructionNode * node, const int * mem)
+{
+    int op1 = mem[node->assign_inst.operand1_index];
+    switch (node->assign_inst.op)
+    {
+        case OPERATOR_PLUS:  return op1 + mem[node->assign_inst.operand2_index];
+        case OPERATOR_MINUS: return op1 - mem[node->assign_inst.operand2_index];
+        case OPERATOR_MULT:  return op1 * mem[node->assign_inst.operand2_index];
+        case OPERATOR_DIV:   return op1 / mem[node->assign_inst.operand2_index];
+        default:             return op1;
+    }
+}
+
+static bool condition_holds(InstructionNode * node, const int * mem)
+{
+    int op1 = mem[node->cjmp_inst.operand1_index];
+    int op2 = mem[node->cjmp_inst.operand2_index];
+    switch (node->cjmp_inst.condition_op)
+    {
+        case CONDITION_GREATER:       return op1 > op2;
+        case CONDITION_LESS:          return op1 < op2;
+        case CONDITION_NOTEQUAL:      return op1 != op2;
+        case CONDITION_EQUAL:         return op1 == op2;
+        case CONDITION_GREATER_EQUAL: return op1 >= op2;
+        case CONDITION_LESS_EQUAL:    return op1 <= op2;
+        default:
+            debug("Error: invalid value for condition_op (%d).\n", node->cjmp_inst.condition_op);
+            exit(1);
+    }
+}
+
+void profile_program(CompiledProgram & program, ExecutionContext & context,
+                     ExecutionProfile & profile)
+{
+    linearize_program(program, profile.linear);
+    const vector<InstructionNode*> & code = profile.linear.code;
+    const vector<int> & target = profile.linear.target;
+    profile.executions.assign(code.size(), 0);
+    profile.taken.assign(code.size(), 0);
+
+    int * mem = context.mem;
+    size_t pc = 0;
+    while (pc < code.size())
+    {
+        InstructionNode * node = code[pc];
+        profile.executions[pc]++;
+        switch (node->type)
+        {
+            case NOOP:
+                pc++;
+                break;
+            case IN:
+                mem[node->input_inst.var_index] = context.NextInput();
+                if (context.error != NULL)
+                    return;
+                pc++;
+                break;
+            case OUT:
+                context.output->WriteInt(mem[node->output_inst.var_index]);
+                pc++;
+                break;
+            case ASSIGN:
+                mem[node->assign_inst.left_hand_side_index] = assign_result(node, mem);
+                pc++;
+                break;
+            case CJMP:
+                if (condition_holds(node, mem))
+                {
+                    pc++;
+                }
+                else
+                {
+                    profile.taken[pc]++;
+                    pc = target[pc];
+                }
+                break;
+            case JMP:
+                pc = target[pc];
+                break;
+            default:
+                debug("Error: invalid value for pc->type (%d).\n", node->type);
+                exit(1);
+                break;
+        }
+    }
+}
+
+/*
+ * Finds the natural loops of the profiled code and the innermost one around
+ * every position, -1 outside loops. JMPs and NOOPs belong to no block: a JMP
+ * goes with the block it ends and a NOOP label with the one it starts.
+ */
+static void attribute_loops(const ExecutionProfile & profile, ControlFlowGraph & cfg,
+                            vector<int> & loop_of, vector<uint64_t> & header_runs)
+{
+    const vector<InstructionNode*> & code = profile.linear.code;
+    cfg.Build(profile.linear);
+    cfg.Analyze();
+
+    unordered_map<InstructionNode*, int> block_of;
+    for (size_t b = 0; b < cfg.blocks.size(); b++)
+    {
+        const BasicBlock & block = cfg.blocks[b];
+        for (size_t i = 0; i < block.code.size(); i++)
+            block_of[block.code[i]] = b;
+        if (block.branch != NULL)
+            block_of[block.branch] = b;
+    }
+
+    vector<int> block(code.size(), -1);
+    vector<bool> first(cfg.blocks.size(), true);
+    header_runs.assign(cfg.loops.size(), 0);
+    for (size_t i = 0; i < code.size(); i++)
+    {
+        unordered_map<InstructionNode*, int>::const_iterator found = block_of.find(code[i]);
+        if (found != block_of.end())
+        {
+            block[i] = found->second;
+            int loop = cfg.blocks[block[i]].loop;
+            if (first[block[i]] && loop >= 0 && cfg.loops[loop].header == block[i])
+                header_runs[loop] = profile.executions[i];
+            first[block[i]] = false;
+        }
+        else if (code[i]->type == JMP && i > 0)
+        {
+            block[i] = block[i - 1];
+        }
+    }
+    for (size_t i = code.size(); i-- > 0; )
+    {
+        if (block[i] < 0 && i + 1 < code.size())
+            block[i] = block[i + 1];
+    }
+
+    loop_of.assign(code.size(), -1);
+    for (size_t i = 0; i < code.size(); i++)
+    {
+        if (block[i] >= 0)
+            loop_of[i] = cfg.blocks[block[i]].loop;
+    }
+}
+
+// The line a loop is reported under: that of the first instruction of its
+// header, which is the test of a WHILE or FOR
+static int loop_line(const ControlFlowGraph & cfg, int loop)
+{
+    const BasicBlock & header = cfg.blocks[cfg.loops[loop].header];
+    if (!header.code.empty())
+        return header.code[0]->line_no;
+    return header.branch != NULL ? header.branch->line_no : 0;
+}
+
+struct LineCounts
+{
+    LineCounts() : executions(0), branches(0), taken(0) {}
+
+    uint64_t executions;
+    uint64_t branches;      // executions of CJMPs
+    uint64_t taken;
+};
+
+static double share(uint64_t part, uint64_t total)
+{
+    return total == 0 ? 0.0 : 100.0 * part / total;
+}
+
+void write_profile_report(const ExecutionProfile & profile, FILE * out)
+{
+    const vector<InstructionNode*> & code = profile.linear.code;
+    ControlFlowGraph cfg;
+    vector<int> loop_of;
+    vector<uint64_t> header_runs;
+    attribute_loops(profile, cfg, loop_of, header_runs);
+
+    map<int, LineCounts> lines;
+    vector<uint64_t> loop_total(cfg.loops.size(), 0);
+    uint64_t total = 0;
+    for (size_t i = 0; i < code.size(); i++)
+    {
+        uint64_t count = profile.executions[i];
+        if (count == 0)
+            continue;
+        total += count;
+        LineCounts & line = lines[code[i]->line_no];
+        line.executions += count;
+        if (code[i]->type == CJMP)
+        {
+            line.branches += count;
+            line.taken += profile.taken[i];
+        }
+        for (int loop = loop_of[i]; loop >= 0; loop = cfg.loops[loop].parent)
+            loop_total[loop] += count;
+    }
+
+    fprintf(out, "profile: %llu instructions executed\n", (unsigned long long) total);
+    fprintf(out, "%8s %14s %7s %14s %14s\n", "line", "executions", "share", "taken", "not taken");
+    for (map<int, LineCounts>::const_iterator it = lines.begin(); it != lines.end(); ++it)
+    {
+        const LineCounts & line = it->second;
+        if (it->first > 0)
+            fprintf(out, "%8d", it->first);
+        else
+            fprintf(out, "%8s", "-");
+        fprintf(out, " %14llu %6.1f%%", (unsigned long long) line.executions,
+                share(line.executions, total));
+        if (line.branches > 0)
+            fprintf(out, " %14llu %14llu\n", (unsigned long long) line.taken,
+                    (unsigned long long) (line.branches - line.taken));
+        else
+            fprintf(out, " %14s %14s\n", "-", "-");
+    }
+
+    if (cfg.loops.empty())
+        return;
+    fprintf(out, "%8s %6s %14s %14s %7s\n", "loop", "depth", "header runs", "instructions", "share");
+    for (size_t l = 0; l < cfg.loops.size(); l++)
+    {
+        fprintf(out, "%8d %6d %14llu %14llu %6.1f%%\n", loop_line(cfg, l), cfg.loops[l].depth,
+                (unsigned long long) header_runs[l], (unsigned long long) loop_total[l],
+                share(loop_total[l], total));
+    }
+}
+
+void write_folded_stacks(const ExecutionProfile & profile, FILE * out)
+{
+    const vector<InstructionNode*> & code = profile.linear.code;
+    ControlFlowGraph cfg;
+    vector<int> loop_of;
+    vector<uint64_t> header_runs;
+    attribute_loops(profile, cfg, loop_of, header_runs);
+
+    map<string, uint64_t> stacks;
+    for (size_t i = 0; i < code.size(); i++)
+    {
+        if (profile.executions[i] == 0)
+            continue;
+        string frames = ";line:" + to_string(code[i]->line_no);
+        for (int loop = loop_of[i]; loop >= 0; loop = cfg.loops[loop].parent)
+            frames = ";loop:" + to_string(loop_line(cfg, loop)) + frames;
+        stacks["program" + frames] += profile.executions[i];
+    }
+    for (map<string, uint64_t>::const_iterator it = stacks.begin(); it != stacks.end(); ++it)
+        fprintf(out, "%s %llu\n", it->first.c_str(), (unsigned long long) it->second);
+}
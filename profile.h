@@ -0,0 +1,38 @@
+#ifndef _PROFILE_H_
+#define _PROFILE_H_
+
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+#include "cfg.h"
+#include "compiler.h"
+
+/*
+ * Execution counts of one run, by position in the linear form of the
+ * program. taken counts the times a CJMP jumped to its target, i.e. its
+ * condition failed; its other executions fell through.
+ */
+struct ExecutionProfile
+{
+    LinearCode linear;
+    std::vector<uint64_t> executions;
+    std::vector<uint64_t> taken;
+};
+
+/*
+ * Runs program like execute_program() while counting every instruction
+ * executed and every CJMP taken. Profiling is a separate interpreter, so
+ * runs that do not ask for a profile pay nothing for it.
+ */
+void profile_program(CompiledProgram & program, ExecutionContext & context,
+                     ExecutionProfile & profile);
+
+// Writes the counts by source line, then by natural loop, to out
+void write_profile_report(const ExecutionProfile & profile, FILE * out);
+
+// Writes the counts in the folded stack format of flame graph tools: one
+// line "program;loop:L;...;line:N count" per source line and loop nest
+void write_folded_stacks(const ExecutionProfile & profile, FILE * out);
+
+#endif /* _PROFILE_H_ */
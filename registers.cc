@@ -0,0 +1,520 @@
+#include <algorithm>
+#include <functional>
+#include <queue>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "bytecode.h"
+#include "cfg.h"
+#include "ssa.h"
+
+using namespace std;
+
+/*
+ * One instruction of the register form. node is the IN, OUT, ASSIGN or CJMP
+ * it comes from, or NULL for a copy of the constant uses[0] into def that
+ * stands in for a phi argument. def and uses are SSA values, -1 if unused.
+ */
+struct RegisterOp {
+    InstructionNode * node;
+    int def;
+    int uses[2];
+};
+
+/*
+ * Straight-line register form code. Block 0 sets up the phis of the entry,
+ * block b + 1 holds graph block b and blocks after those hold the copies of
+ * one edge. When the last op is a CJMP control goes to next if its condition
+ * holds and to target otherwise; -1 halts.
+ */
+struct RegisterBlock {
+    vector<RegisterOp> ops;
+    int next;
+    int target;
+
+    // Positions of the first and last op, where a use at op p is at 2 * p
+    // and a write at 2 * p + 1. An empty block still takes one op position.
+    int start;
+    int end;
+};
+
+struct LiveInterval {
+    int start;
+    int end;
+    int web;
+};
+
+static bool starts_before(const LiveInterval & a, const LiveInterval & b)
+{
+    if (a.start != b.start)
+        return a.start < b.start;
+    return a.web < b.web;
+}
+
+static RegisterOp make_op(InstructionNode * node, int def, int use0, int use1)
+{
+    RegisterOp op;
+    op.node = node;
+    op.def = def;
+    op.uses[0] = use0;
+    op.uses[1] = use1;
+    return op;
+}
+
+static RegisterBlock make_block(int next, int target)
+{
+    RegisterBlock block;
+    block.next = next;
+    block.target = target;
+    block.start = block.end = 0;
+    return block;
+}
+
+// Appends the copies giving the phis of succ their constant arguments on
+// its incoming edge k. The other arguments share a web with the phi.
+static void append_phi_copies(const SsaForm & ssa, int succ, int k, vector<RegisterOp> & ops)
+{
+    const vector<SsaPhi> & phis = ssa.blocks[succ].phis;
+    for (size_t p = 0; p < phis.size(); p++)
+    {
+        int arg = phis[p].args[k];
+        if (ssa.values[arg].kind == SSA_CONSTANT)
+            ops.push_back(make_op(NULL, phis[p].value, arg, -1));
+    }
+}
+
+static int predecessor_index(const ControlFlowGraph & cfg, int pred, int succ)
+{
+    const vector<int> & preds = cfg.blocks[succ].predecessors;
+    size_t k = 0;
+    while (preds[k] != pred)
+        k++;
+    return k;
+}
+
+// The register block that the edge from graph block b to succ leads to:
+// succ's own, or a new one right after b's holding the phi copies of the edge
+static int route_edge(const ControlFlowGraph & cfg, const SsaForm & ssa, int b, int succ,
+                      vector<RegisterBlock> & blocks, vector<int> & order)
+{
+    if (succ < 0)
+        return -1;
+    if (ssa.blocks[succ].phis.empty())
+        return succ + 1;
+    vector<RegisterOp> copies;
+    append_phi_copies(ssa, succ, predecessor_index(cfg, b, succ), copies);
+    if (copies.empty())
+        return succ + 1;
+    blocks.push_back(make_block(succ + 1, -1));
+    blocks.back().ops.swap(copies);
+    order.push_back(blocks.size() - 1);
+    return blocks.size() - 1;
+}
+
+// Lays the graph out as register blocks in the order they will be emitted
+static void build_blocks(const ControlFlowGraph & cfg, const SsaForm & ssa,
+                         vector<RegisterBlock> & blocks, vector<int> & order)
+{
+    int count = cfg.blocks.size();
+    blocks.assign(count + 1, make_block(-1, -1));
+    order.clear();
+
+    blocks[0].next = 1;
+    append_phi_copies(ssa, 0, cfg.blocks[0].predecessors.size(), blocks[0].ops);
+    order.push_back(0);
+
+    for (int b = 0; b >= 0; b = cfg.layout_next[b])
+    {
+        const BasicBlock & block = cfg.blocks[b];
+        if (!block.reachable)
+            continue;
+        const SsaBlock & values = ssa.blocks[b];
+        int id = b + 1;
+        order.push_back(id);
+        vector<RegisterOp> & ops = blocks[id].ops;
+        size_t n = block.code.size();
+        for (size_t i = 0; i < n; i++)
+            ops.push_back(make_op(block.code[i], values.results[i],
+                                  values.operands[2 * i], values.operands[2 * i + 1]));
+        if (block.branch == NULL)
+        {
+            if (block.next >= 0 && !ssa.blocks[block.next].phis.empty())
+                append_phi_copies(ssa, block.next, predecessor_index(cfg, b, block.next), ops);
+            blocks[id].next = block.next >= 0 ? block.next + 1 : -1;
+            continue;
+        }
+        ops.push_back(make_op(block.branch, -1, values.operands[2 * n], values.operands[2 * n + 1]));
+        int next = route_edge(cfg, ssa, b, block.next, blocks, order);
+        int target = route_edge(cfg, ssa, b, block.target, blocks, order);
+        blocks[id].next = next;
+        blocks[id].target = target;
+    }
+}
+
+/*
+ * Live interval of every web: the hull of its writes, its reads and the
+ * blocks it is live into or out of. Liveness comes from walking back from
+ * each read that precedes any write in its block, up to the blocks writing
+ * the web, so it costs the total length of the live ranges.
+ */
+static void compute_intervals(vector<RegisterBlock> & blocks, const vector<int> & order,
+                              const vector<int> & web_of, int web_count,
+                              vector<LiveInterval> & intervals)
+{
+    int count = blocks.size();
+    intervals.resize(web_count);
+    for (int w = 0; w < web_count; w++)
+    {
+        intervals[w].start = INT_MAX;
+        intervals[w].end = -1;
+        intervals[w].web = w;
+    }
+
+    vector< vector<int> > predecessors(count);
+    vector< pair<int, int> > exposed;       // web, block reading it first
+    vector< pair<int, int> > writes;        // web, block writing it
+    vector<int> written(web_count, -1);
+    int position = 0;
+    for (size_t k = 0; k < order.size(); k++)
+    {
+        int b = order[k];
+        RegisterBlock & block = blocks[b];
+        if (block.next >= 0)
+            predecessors[block.next].push_back(b);
+        if (block.target >= 0 && block.target != block.next)
+            predecessors[block.target].push_back(b);
+
+        block.start = 2 * position;
+        for (size_t i = 0; i < block.ops.size(); i++, position++)
+        {
+            const RegisterOp & op = block.ops[i];
+            for (int u = 0; u < 2; u++)
+            {
+                int w = op.uses[u] >= 0 ? web_of[op.uses[u]] : -1;
+                if (w < 0)
+                    continue;
+                intervals[w].start = min(intervals[w].start, 2 * position);
+                intervals[w].end = max(intervals[w].end, 2 * position);
+                if (written[w] != b)
+                    exposed.push_back(make_pair(w, b));
+            }
+            int w = op.def >= 0 ? web_of[op.def] : -1;
+            if (w >= 0)
+            {
+                intervals[w].start = min(intervals[w].start, 2 * position + 1);
+                intervals[w].end = max(intervals[w].end, 2 * position + 1);
+                if (written[w] != b)
+                    writes.push_back(make_pair(w, b));
+                written[w] = b;
+            }
+        }
+        if (block.ops.empty())
+            position++;
+        block.end = 2 * position - 1;
+    }
+
+    sort(exposed.begin(), exposed.end());
+    sort(writes.begin(), writes.end());
+    vector<int> writes_web(count, -1);
+    vector<int> live_in(count, -1);
+    vector<int> live_out(count, -1);
+    vector<int> worklist;
+    size_t x = 0;
+    size_t y = 0;
+    while (x < exposed.size())
+    {
+        int w = exposed[x].first;
+        for (; y < writes.size() && writes[y].first <= w; y++)
+        {
+            if (writes[y].first == w)
+                writes_web[writes[y].second] = w;
+        }
+        LiveInterval & interval = intervals[w];
+        for (; x < exposed.size() && exposed[x].first == w; x++)
+        {
+            int b = exposed[x].second;
+            if (live_in[b] == w)
+                continue;
+            live_in[b] = w;
+            worklist.push_back(b);
+            while (!worklist.empty())
+            {
+                int c = worklist.back();
+                worklist.pop_back();
+                interval.start = min(interval.start, blocks[c].start);
+                for (size_t p = 0; p < predecessors[c].size(); p++)
+                {
+                    int pred = predecessors[c][p];
+                    if (live_out[pred] != w)
+                    {
+                        live_out[pred] = w;
+                        interval.end = max(interval.end, blocks[pred].end);
+                        interval.start = min(interval.start, blocks[pred].end);
+                    }
+                    if (writes_web[pred] != w && live_in[pred] != w)
+                    {
+                        live_in[pred] = w;
+                        worklist.push_back(pred);
+                    }
+                }
+            }
+        }
+    }
+}
+
+/*
+ * Linear scan allocation (Poletto and Sarkar): intervals are visited by
+ * start and take a free register; when none is free the interval ending
+ * last, among the active ones and the new one, is spilled. Spilled
+ * intervals then share spill slots by a second scan of the same kind.
+ * Returns the number of spill slots and fills location.
+ */
+static int allocate_registers(vector<LiveInterval> & intervals, vector<int> & location)
+{
+    sort(intervals.begin(), intervals.end(), starts_before);
+    location.assign(intervals.size(), -1);
+
+    vector<int> free_registers;
+    for (int r = REGISTER_COUNT - 1; r >= 0; r--)
+        free_registers.push_back(r);
+    vector<int> active;         // indices into intervals holding a register
+    vector<int> spilled;
+    for (size_t i = 0; i < intervals.size(); i++)
+    {
+        const LiveInterval & current = intervals[i];
+        if (current.end < 0)
+            continue;
+        size_t kept = 0;
+        for (size_t a = 0; a < active.size(); a++)
+        {
+            if (intervals[active[a]].end < current.start)
+                free_registers.push_back(location[intervals[active[a]].web]);
+            else
+                active[kept++] = active[a];
+        }
+        active.resize(kept);
+
+        if (!free_registers.empty())
+        {
+            location[current.web] = free_registers.back();
+            free_registers.pop_back();
+            active.push_back(i);
+            continue;
+        }
+        size_t last = 0;
+        for (size_t a = 1; a < active.size(); a++)
+        {
+            if (intervals[active[a]].end > intervals[active[last]].end)
+                last = a;
+        }
+        const LiveInterval & victim = intervals[active[last]];
+        if (victim.end > current.end)
+        {
+            location[current.web] = location[victim.web];
+            spilled.push_back(active[last]);
+            active[last] = i;
+        }
+        else
+        {
+            spilled.push_back(i);
+        }
+    }
+
+    // Spilled intervals were collected out of start order
+    sort(spilled.begin(), spilled.end());
+    typedef pair<int, int> Ending;      // end, slot
+    priority_queue<Ending, vector<Ending>, greater<Ending> > busy;
+    vector<int> free_slots;
+    int slot_count = 0;
+    for (size_t k = 0; k < spilled.size(); k++)
+    {
+        const LiveInterval & current = intervals[spilled[k]];
+        while (!busy.empty() && busy.top().first < current.start)
+        {
+            free_slots.push_back(busy.top().second);
+            busy.pop();
+        }
+        int slot;
+        if (free_slots.empty())
+        {
+            slot = slot_count++;
+        }
+        else
+        {
+            slot = free_slots.back();
+            free_slots.pop_back();
+        }
+        location[current.web] = REGISTER_COUNT + slot;
+        busy.push(make_pair(current.end, slot));
+    }
+    return slot_count;
+}
+
+// Frame index of an operand: its web's location, or a constant slot
+static uint32_t operand_slot(const SsaForm & ssa, const vector<int> & web_of,
+                             const vector<int> & location, int value,
+                             unordered_map<int, int> & constant_slots,
+                             BytecodeProgram & bytecode, vector<bool> & is_constant)
+{
+    if (web_of[value] >= 0)
+        return location[web_of[value]];
+    int constant = ssa.values[value].constant;
+    unordered_map<int, int>::iterator it = constant_slots.find(constant);
+    if (it != constant_slots.end())
+        return it->second;
+    int slot = bytecode.frame_image.size();
+    bytecode.frame_image.push_back(constant);
+    is_constant.push_back(true);
+    constant_slots[constant] = slot;
+    return slot;
+}
+
+static BytecodeInstruction make_instruction(BytecodeOpcode opcode)
+{
+    BytecodeInstruction inst;
+    inst.opcode = opcode;
+    inst.reserved[0] = inst.reserved[1] = inst.reserved[2] = 0;
+    inst.a = 0;
+    inst.b = 0;
+    inst.c = 0;
+    return inst;
+}
+
+void compile_registers(CompiledProgram & program, BytecodeProgram & bytecode)
+{
+    LinearCode linear;
+    linearize_program(program, linear);
+    ControlFlowGraph cfg;
+    cfg.Build(linear);
+    cfg.Analyze(0);     // only the dominators are needed
+
+    SsaForm ssa;
+    ssa.Build(program, cfg);
+
+    // A phi and its arguments other than constants form one web
+    int value_count = ssa.values.size();
+    vector<int> parent(value_count);
+    for (int v = 0; v < value_count; v++)
+        parent[v] = v;
+    for (size_t b = 0; b < ssa.blocks.size(); b++)
+    {
+        const vector<SsaPhi> & phis = ssa.blocks[b].phis;
+        for (size_t p = 0; p < phis.size(); p++)
+        {
+            for (size_t k = 0; k < phis[p].args.size(); k++)
+            {
+                int arg = phis[p].args[k];
+                if (ssa.values[arg].kind == SSA_CONSTANT)
+                    continue;
+                int x = phis[p].value;
+                while (parent[x] != x)
+                    x = parent[x] = parent[parent[x]];
+                while (parent[arg] != arg)
+                    arg = parent[arg] = parent[parent[arg]];
+                parent[arg] = x;
+            }
+        }
+    }
+    vector<int> web_of(value_count, -1);
+    int web_count = 0;
+    for (int v = 0; v < value_count; v++)
+    {
+        if (ssa.values[v].kind == SSA_CONSTANT)
+            continue;
+        int root = v;
+        while (parent[root] != root)
+            root = parent[root];
+        if (web_of[root] < 0)
+            web_of[root] = web_count++;
+        web_of[v] = web_of[root];
+    }
+
+    vector<RegisterBlock> blocks;
+    vector<int> order;
+    build_blocks(cfg, ssa, blocks, order);
+
+    vector<LiveInterval> intervals;
+    compute_intervals(blocks, order, web_of, web_count, intervals);
+    vector<int> location;
+    int spill_count = allocate_registers(intervals, location);
+
+    bytecode.code.clear();
+    bytecode.frame_image.assign(REGISTER_COUNT + spill_count, 0);
+    vector<bool> is_constant(bytecode.frame_image.size(), false);
+    unordered_map<int, int> constant_slots;
+
+    vector<uint32_t> address(blocks.size(), 0);
+    vector< pair<uint32_t, int> > fixups;       // instruction, register block
+    for (size_t k = 0; k < order.size(); k++)
+    {
+        const RegisterBlock & block = blocks[order[k]];
+        address[order[k]] = bytecode.code.size();
+        for (size_t i = 0; i < block.ops.size(); i++)
+        {
+            const RegisterOp & op = block.ops[i];
+            BytecodeInstruction inst = make_instruction(BC_NOOP);
+            if (op.node == NULL)
+            {
+                inst.opcode = BC_ASSIGN_MOV_IMM;
+                inst.a = location[web_of[op.def]];
+                inst.b = (uint32_t) ssa.values[op.uses[0]].constant;
+            }
+            else if (op.node->type == IN)
+            {
+                inst.opcode = BC_IN;
+                inst.a = location[web_of[op.def]];
+            }
+            else if (op.node->type == OUT)
+            {
+                inst.opcode = BC_OUT;
+                inst.a = operand_slot(ssa, web_of, location, op.uses[0],
+                                      constant_slots, bytecode, is_constant);
+            }
+            else
+            {
+                if (op.node->type == ASSIGN)
+                    inst.a = location[web_of[op.def]];
+                else
+                    fixups.push_back(make_pair((uint32_t) bytecode.code.size(), block.target));
+                inst.b = operand_slot(ssa, web_of, location, op.uses[0],
+                                      constant_slots, bytecode, is_constant);
+                if (op.uses[1] >= 0)
+                    inst.c = operand_slot(ssa, web_of, location, op.uses[1],
+                                          constant_slots, bytecode, is_constant);
+                encode_operation(op.node, is_constant, bytecode.frame_image, inst);
+            }
+            bytecode.code.push_back(inst);
+        }
+
+        int following = k + 1 < order.size() ? order[k + 1] : -1;
+        if (block.next < 0)
+        {
+            bytecode.code.push_back(make_instruction(BC_HALT));
+        }
+        else if (block.next != following)
+        {
+            fixups.push_back(make_pair((uint32_t) bytecode.code.size(), block.next));
+            bytecode.code.push_back(make_instruction(BC_JMP));
+        }
+    }
+
+    // Branches that leave the program share one HALT
+    int halt = -1;
+    for (size_t i = 0; i < fixups.size(); i++)
+    {
+        if (fixups[i].second >= 0)
+        {
+            bytecode.code[fixups[i].first].a = address[fixups[i].second];
+            continue;
+        }
+        if (halt < 0)
+        {
+            halt = bytecode.code.size();
+            bytecode.code.push_back(make_instruction(BC_HALT));
+        }
+        bytecode.code[fixups[i].first].a = halt;
+    }
+    lower_switches(bytecode);
+    fuse_superinstructions(bytecode);
+}
@@ -0,0 +1,220 @@
+#include <utility>
+#include <vector>
+
+#include "ssa.h"
+
+using namespace std;
+
+int SsaForm::NewValue(SsaValueKind kind, int var, int constant)
+{
+    SsaValue value;
+    value.kind = kind;
+    value.var = var;
+    value.constant = constant;
+    values.push_back(value);
+    return values.size() - 1;
+}
+
+int SsaForm::Constant(int value)
+{
+    unordered_map<int, int>::iterator it = constants.find(value);
+    if (it != constants.end())
+        return it->second;
+    int id = NewValue(SSA_CONSTANT, -1, value);
+    constants[value] = id;
+    return id;
+}
+
+void SsaForm::Build(const CompiledProgram & program, const ControlFlowGraph & cfg)
+{
+    int count = cfg.blocks.size();
+    int slot_count = program.memory_image.size();
+    values.clear();
+    constants.clear();
+    blocks.assign(count, SsaBlock());
+
+    // Blocks writing each variable, and the variables some block reads
+    // before writing them
+    vector< vector<int> > def_blocks(slot_count);
+    vector<bool> global(slot_count, false);
+    vector<int> written(slot_count, -1);
+    for (int b = 0; b < count; b++)
+    {
+        const BasicBlock & block = cfg.blocks[b];
+        if (!block.reachable)
+            continue;
+        int reads[2];
+        for (size_t i = 0; i <= block.code.size(); i++)
+        {
+            InstructionNode * node = i < block.code.size() ? block.code[i] : block.branch;
+            if (node == NULL)
+                break;
+            int n = instruction_reads(node, reads);
+            for (int k = 0; k < n; k++)
+            {
+                if (!program.is_constant[reads[k]] && written[reads[k]] != b)
+                    global[reads[k]] = true;
+            }
+            int w = instruction_writes(node);
+            if (w >= 0 && written[w] != b)
+            {
+                written[w] = b;
+                def_blocks[w].push_back(b);
+            }
+        }
+    }
+
+    // Dominance frontiers. The entry counts as one more predecessor of
+    // block 0, whose immediate dominator is then a virtual root above it.
+    vector< vector<int> > frontier(count);
+    for (int b = 0; b < count; b++)
+    {
+        const BasicBlock & block = cfg.blocks[b];
+        if (!block.reachable)
+            continue;
+        int incoming = block.predecessors.size() + (b == 0 ? 1 : 0);
+        if (incoming < 2)
+            continue;
+        int stop = b == 0 ? -1 : block.idom;
+        for (size_t k = 0; k < block.predecessors.size(); k++)
+        {
+            int runner = block.predecessors[k];
+            while (runner != stop)
+            {
+                vector<int> & df = frontier[runner];
+                if (df.empty() || df.back() != b)
+                    df.push_back(b);
+                runner = runner == 0 ? -1 : cfg.blocks[runner].idom;
+            }
+        }
+    }
+
+    // Phis at the iterated dominance frontier of each global variable
+    vector<int> has_phi(count, -1);
+    vector<int> queued(count, -1);
+    vector<int> worklist;
+    for (int v = 0; v < slot_count; v++)
+    {
+        if (!global[v] || def_blocks[v].empty())
+            continue;
+        worklist = def_blocks[v];
+        for (size_t k = 0; k < worklist.size(); k++)
+            queued[worklist[k]] = v;
+        while (!worklist.empty())
+        {
+            int b = worklist.back();
+            worklist.pop_back();
+            for (size_t k = 0; k < frontier[b].size(); k++)
+            {
+                int d = frontier[b][k];
+                if (has_phi[d] == v)
+                    continue;
+                has_phi[d] = v;
+                SsaPhi phi;
+                phi.value = NewValue(SSA_PHI, v, 0);
+                phi.args.assign(cfg.blocks[d].predecessors.size() + (d == 0 ? 1 : 0), -1);
+                blocks[d].phis.push_back(phi);
+                if (queued[d] != v)
+                {
+                    queued[d] = v;
+                    worklist.push_back(d);
+                }
+            }
+        }
+    }
+
+    // Renaming, depth first over the dominator tree. stacks[v] holds the
+    // versions of v visible at the current block, starting from its value
+    // on entry; pushed logs what each open block pushed.
+    vector< vector<int> > children(count);
+    for (int b = 1; b < count; b++)
+    {
+        if (cfg.blocks[b].reachable)
+            children[cfg.blocks[b].idom].push_back(b);
+    }
+    vector< vector<int> > stacks(slot_count);
+    for (int v = 0; v < slot_count; v++)
+    {
+        if (!program.is_constant[v])
+            stacks[v].push_back(Constant(program.memory_image[v]));
+    }
+    for (size_t k = 0; k < blocks[0].phis.size(); k++)
+    {
+        SsaPhi & phi = blocks[0].phis[k];
+        phi.args.back() = stacks[values[phi.value].var][0];
+    }
+
+    vector<int> pushed;
+    vector< pair<int, size_t> > walk;     // block, next child to visit
+    vector<size_t> marks;                 // size of pushed when each block opened
+    walk.push_back(make_pair(0, 0));
+    marks.push_back(0);
+    bool opened = false;
+    while (!walk.empty())
+    {
+        int b = walk.back().first;
+        if (!opened)
+        {
+            const BasicBlock & block = cfg.blocks[b];
+            SsaBlock & ssa = blocks[b];
+            for (size_t k = 0; k < ssa.phis.size(); k++)
+            {
+                int v = values[ssa.phis[k].value].var;
+                stacks[v].push_back(ssa.phis[k].value);
+                pushed.push_back(v);
+            }
+            ssa.results.assign(block.code.size(), -1);
+            ssa.operands.assign(2 * (block.code.size() + 1), -1);
+            int reads[2];
+            for (size_t i = 0; i <= block.code.size(); i++)
+            {
+                InstructionNode * node = i < block.code.size() ? block.code[i] : block.branch;
+                if (node == NULL)
+                    break;
+                int n = instruction_reads(node, reads);
+                for (int k = 0; k < n; k++)
+                {
+                    int slot = reads[k];
+                    ssa.operands[2 * i + k] = program.is_constant[slot] ?
+                        Constant(program.memory_image[slot]) : stacks[slot].back();
+                }
+                int w = instruction_writes(node);
+                if (w >= 0)
+                {
+                    ssa.results[i] = NewValue(SSA_RESULT, w, 0);
+                    stacks[w].push_back(ssa.results[i]);
+                    pushed.push_back(w);
+                }
+            }
+            for (size_t s = 0; s < block.successors.size(); s++)
+            {
+                int succ = block.successors[s];
+                vector<SsaPhi> & phis = blocks[succ].phis;
+                if (phis.empty())
+                    continue;
+                const vector<int> & preds = cfg.blocks[succ].predecessors;
+                size_t k = 0;
+                while (preds[k] != b)
+                    k++;
+                for (size_t p = 0; p < phis.size(); p++)
+                    phis[p].args[k] = stacks[values[phis[p].value].var].back();
+            }
+        }
+        if (walk.back().second < children[b].size())
+        {
+            int child = children[b][walk.back().second++];
+            walk.push_back(make_pair(child, 0));
+            marks.push_back(pushed.size());
+            opened = false;
+            continue;
+        }
+        while (pushed.size() > marks.back())
+        {
+            stacks[pushed.back()].pop_back();
+            pushed.pop_back();
+        }
+        walk.pop_back();
+        marks.pop_back();
+        opened = true;
+    }
+}
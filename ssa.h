@@ -0,0 +1,64 @@
+#ifndef _SSA_H_
+#define _SSA_H_
+
+#include <unordered_map>
+#include <vector>
+
+#include "cfg.h"
+#include "compiler.h"
+
+enum SsaValueKind {
+    SSA_CONSTANT,       // a literal, or a variable read before any write
+    SSA_RESULT,         // written by an ASSIGN or IN
+    SSA_PHI
+};
+
+struct SsaValue {
+    SsaValueKind kind;
+    int var;            // slot this is a version of, -1 for constants
+    int constant;       // the value of a constant
+};
+
+// A phi at the start of a block. args[k] is the value arriving from the
+// block's k-th predecessor; block 0 has one more, for the program entry.
+struct SsaPhi {
+    int value;
+    std::vector<int> args;
+};
+
+/*
+ * Values per instruction of the matching BasicBlock. results[i] is the
+ * value code[i] writes, -1 if none, and operands[2 * i], operands[2 * i + 1]
+ * the values it reads, -1 where it reads fewer. The branch's operands follow
+ * those of the last instruction.
+ */
+struct SsaBlock {
+    std::vector<SsaPhi> phis;
+    std::vector<int> results;
+    std::vector<int> operands;
+};
+
+/*
+ * Static single assignment form of a control-flow graph, kept beside the
+ * graph rather than rewriting it. Phis are placed at the iterated dominance
+ * frontier of the writes of every variable that is read in some block before
+ * that block writes it (semi-pruned SSA). Since no copies are folded, the
+ * versions of one variable never overlap, so a phi and its arguments can
+ * share one location when the form is taken apart again.
+ */
+class SsaForm {
+  public:
+    // cfg must have been analyzed. Unreachable blocks get no values.
+    void Build(const CompiledProgram & program, const ControlFlowGraph & cfg);
+
+    std::vector<SsaValue> values;
+    std::vector<SsaBlock> blocks;
+
+  private:
+    int NewValue(SsaValueKind kind, int var, int constant);
+    int Constant(int value);
+
+    std::unordered_map<int, int> constants;     // literal -> value
+};
+
+#endif /* _SSA_H_ */
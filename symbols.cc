@@ -0,0 +1,83 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "symbols.h"
+
+using namespace std;
+
+#define ARENA_BLOCK_SIZE (64 * 1024)
+#define INITIAL_BUCKETS 1024
+
+static uint32_t hash_name(string_view name)
+{
+    uint32_t hash = 2166136261u;        // FNV-1a
+    for (size_t i = 0; i < name.size(); i++) {
+        hash ^= (unsigned char) name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+SymbolTable::SymbolTable()
+    : buckets(INITIAL_BUCKETS, -1), block_cursor(NULL), block_remaining(0)
+{
+}
+
+SymbolTable::~SymbolTable()
+{
+    for (size_t i = 0; i < blocks.size(); i++)
+        free(blocks[i]);
+}
+
+int SymbolTable::Intern(string_view name)
+{
+    uint32_t hash = hash_name(name);
+    size_t mask = buckets.size() - 1;
+
+    for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+        int id = buckets[i];
+        if (id < 0) {
+            id = names.size();
+            names.push_back(string_view(Store(name), name.size()));
+            hashes.push_back(hash);
+            buckets[i] = id;
+            if (names.size() * 2 > buckets.size())
+                Grow();
+            return id;
+        }
+        if (hashes[id] == hash && names[id] == name)
+            return id;
+    }
+}
+
+const char * SymbolTable::Store(string_view name)
+{
+    if (name.size() > block_remaining) {
+        size_t size = name.size() > ARENA_BLOCK_SIZE ? name.size() : ARENA_BLOCK_SIZE;
+        block_cursor = (char *) malloc(size);
+        if (block_cursor == NULL) {
+            fprintf(stderr, "Error: out of memory in the symbol table\n");
+            exit(1);
+        }
+        blocks.push_back(block_cursor);
+        block_remaining = size;
+    }
+    char * copy = block_cursor;
+    memcpy(copy, name.data(), name.size());
+    block_cursor += name.size();
+    block_remaining -= name.size();
+    return copy;
+}
+
+void SymbolTable::Grow()
+{
+    buckets.assign(buckets.size() * 2, -1);
+    size_t mask = buckets.size() - 1;
+    for (size_t id = 0; id < names.size(); id++) {
+        size_t i = hashes[id] & mask;
+        while (buckets[i] >= 0)
+            i = (i + 1) & mask;
+        buckets[i] = id;
+    }
+}
@@ -0,0 +1,38 @@
+#ifndef _SYMBOLS_H_
+#define _SYMBOLS_H_
+
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+/*
+ * Maps identifier names to dense integer ids 0, 1, 2, ... in order of first
+ * appearance. Names are copied into arena blocks owned by the table, so the
+ * views returned by Name() stay valid for the table's lifetime.
+ */
+class SymbolTable {
+  public:
+    SymbolTable();
+    ~SymbolTable();
+
+    int Intern(std::string_view name);
+    std::string_view Name(int id) { return names[id]; }
+    int Count() { return names.size(); }
+
+  private:
+    SymbolTable(const SymbolTable &);
+    SymbolTable & operator=(const SymbolTable &);
+
+    const char * Store(std::string_view name);
+    void Grow();
+
+    std::vector<std::string_view> names;
+    std::vector<uint32_t> hashes;       // hash of names[id]
+    std::vector<int> buckets;           // open addressing, -1 = empty
+
+    std::vector<char *> blocks;
+    char * block_cursor;
+    size_t block_remaining;
+};
+
+#endif /* _SYMBOLS_H_ */
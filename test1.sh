@@ -1,5 +1,7 @@
 #!/bin/bash
 
+# Any arguments are passed through to a.out, e.g. ./test1.sh --engine=switch
+
 let passed=0
 let all=0
 
@@ -20,7 +22,7 @@ for txt_file in provided_tests/*.txt; do
 	all=$((all+1))
 
     # Run the .txt file through a.out and save the output
-    ./a.out < "$txt_file" > "${txt_file}.output"
+    ./a.out "$@" < "$txt_file" > "${txt_file}.output"
 
     # Compare the output with the expected file
     if diff -Bw "${txt_file}.output" "$expected_file" > /dev/null; then